@@ -0,0 +1,196 @@
+/*****************************************************************************
+ * allowlist.h: clients we accept datagrams from
+ *****************************************************************************
+ * Copyright (C) 2011 Kai Hermann
+ *
+ * Authors: Kai Hermann <kai.uwe.hermann at gmail dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/* Single addresses go into an open addressing hash set, CIDR blocks into
+ * a binary trie. Both are built once at startup, a datagram costs one
+ * hash probe and, only if that misses, a walk down the trie that ends at
+ * the first matching prefix. Addresses are kept in host byte order. */
+
+struct trienode {
+	unsigned int child[2];	/* index into nodes, 0 = none */
+	int match;		/* a prefix ends here */
+};
+
+struct allowlist {
+	uint32_t *hosts;	/* 0 = empty slot */
+	unsigned int mask;	/* hash size - 1 */
+	unsigned int bits;	/* hash size = 1 << bits */
+	unsigned int nhosts;
+	int zero;		/* 0.0.0.0 itself is listed */
+
+	struct trienode *nodes;	/* nodes[0] is the root */
+	unsigned int nnodes, maxnodes;
+	unsigned int nprefixes;
+};
+
+/* Fibonacci hashing: the top bits of addr * 2^32/phi, spreads
+ * neighbouring addresses over the table */
+unsigned int allow_hash(struct allowlist *a, uint32_t addr)
+{
+	return (addr * 2654435769U) >> (32 - a->bits);
+}
+
+void allow_init(struct allowlist *a)
+{
+	memset(a, 0, sizeof(*a));
+	a->bits = 4;
+	a->mask = (1U << a->bits) - 1;
+	a->hosts = calloc(a->mask + 1, sizeof(uint32_t));
+	a->maxnodes = 64;
+	a->nodes = calloc(a->maxnodes, sizeof(struct trienode));
+	a->nnodes = 1;
+
+	if (a->hosts == NULL || a->nodes == NULL) {
+		die("Unable to allocate client table");
+	}
+}
+
+void allow_add_host(struct allowlist *a, uint32_t addr);
+
+/* keep the hash at most half full */
+void allow_grow(struct allowlist *a)
+{
+	uint32_t *old = a->hosts;
+	unsigned int i, size = a->mask + 1;
+
+	a->bits++;
+	a->mask = size * 2 - 1;
+	a->hosts = calloc(a->mask + 1, sizeof(uint32_t));
+	if (a->hosts == NULL) {
+		die("Unable to allocate client table");
+	}
+	a->nhosts = 0;
+	for (i = 0; i < size; i++) {
+		if (old[i] != 0)
+			allow_add_host(a, old[i]);
+	}
+	free(old);
+}
+
+void allow_add_host(struct allowlist *a, uint32_t addr)
+{
+	unsigned int i;
+
+	if (addr == 0) {
+		a->zero = 1;
+		return;
+	}
+
+	if ((a->nhosts + 1) * 2 > a->mask + 1)
+		allow_grow(a);
+
+	for (i = allow_hash(a, addr); a->hosts[i] != 0; i = (i + 1) & a->mask) {
+		if (a->hosts[i] == addr)
+			return;
+	}
+	a->hosts[i] = addr;
+	a->nhosts++;
+}
+
+void allow_add_prefix(struct allowlist *a, uint32_t addr, int len)
+{
+	unsigned int node = 0;
+	int bit, i;
+
+	for (i = 0; i < len; i++) {
+		bit = (addr >> (31 - i)) & 1;
+		if (a->nodes[node].child[bit] == 0) {
+			if (a->nnodes == a->maxnodes) {
+				a->maxnodes *= 2;
+				a->nodes = realloc(a->nodes, a->maxnodes * sizeof(struct trienode));
+				if (a->nodes == NULL) {
+					die("Unable to allocate client table");
+				}
+			}
+			memset(&a->nodes[a->nnodes], 0, sizeof(struct trienode));
+			a->nodes[node].child[bit] = a->nnodes++;
+		}
+		node = a->nodes[node].child[bit];
+	}
+	a->nodes[node].match = 1;
+	a->nprefixes++;
+}
+
+/* add "a.b.c.d" or "a.b.c.d/len", returns -1 if it isn't either */
+int allow_add(struct allowlist *a, const char *spec)
+{
+	char ip[INET_ADDRSTRLEN];
+	const char *slash = strchr(spec, '/');
+	struct in_addr in;
+	uint32_t addr;
+	int len = 32, n;
+
+	if (slash != NULL) {
+		if (slash - spec >= (int)sizeof(ip))
+			return -1;
+		memcpy(ip, spec, slash - spec);
+		ip[slash - spec] = '\0';
+		if (sscanf(slash + 1, "%i%n", &len, &n) != 1 || slash[1 + n] != '\0'
+			|| len < 0 || len > 32)
+			return -1;
+	} else {
+		if (strlen(spec) >= sizeof(ip))
+			return -1;
+		strcpy(ip, spec);
+	}
+
+	if (inet_pton(AF_INET, ip, &in) < 1)
+		return -1;
+
+	addr = ntohl(in.s_addr);
+	if (len == 32) {
+		allow_add_host(a, addr);
+	} else {
+		/* host bits don't matter, 10.1.2.3/8 is 10.0.0.0/8 */
+		allow_add_prefix(a, len == 0 ? 0 : addr & (0xffffffffU << (32 - len)), len);
+	}
+	return 0;
+}
+
+/* per datagram: is this source address (network byte order) allowed? */
+int allow_check(struct allowlist *a, in_addr_t s_addr)
+{
+	uint32_t addr = ntohl(s_addr);
+	unsigned int i, node = 0;
+	int bit;
+
+	if (addr == 0)
+		return a->zero;
+
+	for (i = allow_hash(a, addr); a->hosts[i] != 0; i = (i + 1) & a->mask) {
+		if (a->hosts[i] == addr)
+			return 1;
+	}
+
+	if (a->nprefixes == 0)
+		return 0;
+
+	for (bit = 31; ; bit--) {
+		if (a->nodes[node].match)
+			return 1;
+		if (bit < 0)
+			return 0;
+		node = a->nodes[node].child[(addr >> bit) & 1];
+		if (node == 0)
+			return 0;
+	}
+}
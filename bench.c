@@ -0,0 +1,860 @@
+/*****************************************************************************
+ * bench: micro benchmarks of the server's hot paths
+ *****************************************************************************
+ * Copyright (C) 2011 Kai Hermann
+ *
+ * Authors: Kai Hermann <kai.uwe.hermann at gmail dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/* Runs the server's per-frame code on tables and frames of its own, so
+ * the numbers don't depend on how the server happens to be started.
+ * The engine and worker benchmarks run the server binary itself
+ * (--server) with a pty as its serial port. Build with the same CFLAGS
+ * as the server, "make bench". */
+
+#define _GNU_SOURCE
+
+#include "git_rev.h"
+
+#define VERSION "0.4"
+#define PROGNAME "eiwomisarc_bench"
+#define COPYRIGHT "2009-2011, Kai Hermann"
+#define BUFFSIZE 6
+#define MAXDATAGRAM 1472
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sched.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/* message functions */
+#include "messages.h"
+
+/* argtable */
+#include "argtable2/argtable2.h"
+
+/* reactor_now() */
+#include "reactor.h"
+
+/* client allowlist */
+#include "allowlist.h"
+
+/* frame_build(), CHANNELS */
+#include "coalesce.h"
+
+/* checkbuffer() */
+#include "frame.h"
+
+/* the transport benchmarks count what would reach the server */
+unsigned long bench_frames, bench_target;
+
+void handle_datagram(unsigned char *buffer, int received,
+					 struct sockaddr_in *client, struct allowlist *allow, uint64_t rxstamp)
+{
+	bench_frames += received / BUFFSIZE;
+	if (bench_frames >= bench_target)
+		reactor_running = 0;
+}
+
+/* shared memory ring, server side */
+#include "shmingest.h"
+
+/* every benchmark, in the order they run */
+const char *benchmarks[] = { "allowlist", "checkbuffer", "shm", "udp", "engines", "workers", NULL };
+
+/* was the benchmark asked for? none named = all of them */
+int bench_wanted(struct arg_str *names, const char *name)
+{
+	int i;
+
+	for (i = 0; i < names->count; i++) {
+		if (strcmp(names->sval[i], name) == 0)
+			return 1;
+	}
+	return names->count == 0;
+}
+
+/* nanoseconds per call and calls per second */
+void bench_report(const char *name, unsigned long calls, uint64_t elapsed)
+{
+	if (elapsed == 0)
+		elapsed = 1;
+	printf("%-28s %8.2f ns/op %10.1f M/s\n", name, (double)elapsed / calls,
+		   calls * 1e3 / elapsed);
+}
+
+/* xorshift, the same sequence on every run */
+uint32_t bench_random(uint32_t *state)
+{
+	uint32_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+/* allow_check() against nhosts addresses and nprefixes networks in
+ * 10.0.0.0/8, probed with listed hosts, addresses inside a listed
+ * network and addresses that match nothing, a third each */
+void bench_allowlist(unsigned int nhosts, unsigned int nprefixes, unsigned long rounds)
+{
+	struct allowlist a;
+	uint32_t seed = 42, *hosts, probes[4096];
+	unsigned long i, hits = 0, probelen = 0;
+	uint64_t start;
+	char name[64];
+
+	allow_init(&a);
+	hosts = calloc(nhosts + 1, sizeof(uint32_t));
+	if (hosts == NULL) {
+		die("Unable to allocate hosts");
+	}
+	for (i = 0; i < nhosts; i++) {
+		hosts[i] = 0x0a000000 | (bench_random(&seed) & 0x00ffffff);
+		allow_add_host(&a, hosts[i]);
+	}
+	for (i = 0; i < nprefixes; i++) {
+		/* /24s in 10.128.0.0/9, the hosts are anywhere in 10/8 */
+		allow_add_prefix(&a, 0x0a800000 | ((uint32_t)i << 8), 24);
+	}
+
+	/* how far a listed host is from its home slot */
+	for (i = 0; i < nhosts; i++) {
+		unsigned int slot = allow_hash(&a, hosts[i]);
+
+		while (a.hosts[slot] != hosts[i]) {
+			slot = (slot + 1) & a.mask;
+			probelen++;
+		}
+	}
+
+	for (i = 0; i < 4096; i++) {
+		uint32_t r = bench_random(&seed);
+
+		if (i % 3 == 0 && nhosts > 0)
+			probes[i] = hosts[r % nhosts];
+		else if (i % 3 == 1 && nprefixes > 0)
+			probes[i] = 0x0a800000 | ((r % nprefixes) << 8) | (r >> 24);
+		else
+			probes[i] = 0xc0a80000 | (r & 0xffff);	/* 192.168/16 */
+		probes[i] = htonl(probes[i]);
+	}
+
+	start = reactor_now();
+	for (i = 0; i < rounds; i++) {
+		hits += allow_check(&a, probes[i & 4095]);
+	}
+	snprintf(name, sizeof(name), "allow_check %u+%u", nhosts, nprefixes);
+	bench_report(name, rounds, reactor_now() - start);
+	printf("%-28s %lu hits, %u slots, %.3f extra probes per host\n", "", hits,
+		   a.mask + 1, nhosts > 0 ? (double)probelen / nhosts : 0.0);
+
+	free(hosts);
+}
+
+/* checkbuffer() as it runs in production, debug messages off; one frame
+ * in 256 is broken. Build with -DEIWOMISA_MAX_LOGLEVEL=2 to see what the
+ * compiled out debug messages save. */
+void bench_checkbuffer(unsigned long rounds)
+{
+	unsigned char frames[256][BUFFSIZE];
+	unsigned long i, invalid = 0;
+	uint64_t start;
+
+	for (i = 0; i < 256; i++) {
+		frame_build(frames[i], i * 1237 % CHANNELS, i * 7 % 510);
+	}
+	frames[255][2] = 2;
+
+	msglevel = 2;
+	start = reactor_now();
+	for (i = 0; i < rounds; i++) {
+		invalid += checkbuffer(frames[i & 255]);
+	}
+	bench_report("checkbuffer", rounds, reactor_now() - start);
+	printf("%-28s %lu invalid\n", "", invalid);
+}
+
+/* user + system CPU seconds of the process, all threads */
+double bench_cpu(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec
+		   + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+/* frames/s and CPU per frame of a transport, producer and server
+ * together; lost frames were sent but never arrived */
+void bench_transport_report(const char *name, unsigned long sent, uint64_t elapsed,
+							double cpu, unsigned long wakeups)
+{
+	if (elapsed == 0)
+		elapsed = 1;
+	printf("%-28s %10.0f frames/s %8.2f us CPU/frame %8lu wakeups %8lu lost\n", name,
+		   bench_frames * 1e9 / elapsed, bench_frames > 0 ? cpu * 1e6 / bench_frames : 0.0,
+		   wakeups, sent - bench_frames);
+}
+
+struct bench_producer {
+	unsigned long frames;
+	int noefd;		/* shm: pretend pidfd_getfd() failed, ring the futex */
+	int sock;		/* udp: connected to the server socket */
+	int done;
+};
+
+/* a frame per shmring_put(), spinning while the ring is full */
+void *bench_shm_producer(void *arg)
+{
+	struct bench_producer *bp = arg;
+	struct shmring_producer p;
+	unsigned char frame[BUFFSIZE];
+	unsigned long i;
+
+	if (shmring_attach(&p, "/eiwomisarc_bench") < 0) {
+		die("Unable to attach to the shm ring");
+	}
+	if (bp->noefd && p.efd >= 0) {
+		close(p.efd);
+		p.efd = -1;
+	}
+	for (i = 0; i < bp->frames; i++) {
+		frame_build(frame, i % CHANNELS, i % 510);
+		while (!shmring_put(&p, frame))
+			sched_yield();
+	}
+	shmring_detach(&p);
+	return NULL;
+}
+
+/* the --shm path: producer thread, ring, drain in the loop */
+void bench_shm(unsigned long frames, int noefd)
+{
+	struct bench_producer bp = { frames, noefd, -1, 0 };
+	pthread_t thread;
+	uint64_t start;
+	double cpu;
+
+	shmingest_start(&shmingest, "/eiwomisarc_bench", 65536, 0);
+	bench_frames = 0;
+	bench_target = frames;
+
+	cpu = bench_cpu();
+	start = reactor_now();
+	if (pthread_create(&thread, NULL, bench_shm_producer, &bp) != 0) {
+		die("Unable to start producer");
+	}
+	reactor_run();
+	bench_transport_report(noefd ? "shm, futex doorbell" : "shm, eventfd", frames,
+						   reactor_now() - start, bench_cpu() - cpu, shmingest.wakeups);
+	pthread_join(thread, NULL);
+
+	reactor_del(&shmingest.h);
+	shmingest_stop(&shmingest);
+	shmingest.wakeups = shmingest.frames = 0;
+}
+
+/* a frame per datagram, like most desks send them */
+void *bench_udp_producer(void *arg)
+{
+	struct bench_producer *bp = arg;
+	unsigned char frame[BUFFSIZE];
+	unsigned long i;
+
+	for (i = 0; i < bp->frames; i++) {
+		frame_build(frame, i % CHANNELS, i % 510);
+		while (send(bp->sock, frame, BUFFSIZE, 0) < 0 && errno == ENOBUFS)
+			sched_yield();
+	}
+	__atomic_store_n(&bp->done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+unsigned long bench_udp_wakeups;
+
+void bench_udp_event(struct handler *h, unsigned int events)
+{
+	unsigned char buffer[MAXDATAGRAM];
+	int n;
+
+	bench_udp_wakeups++;
+	while ((n = recv(h->fd, buffer, sizeof(buffer), 0)) > 0) {
+		handle_datagram(buffer, n, NULL, NULL, 0);
+	}
+}
+
+/* the classic receive path over loopback: recv() per datagram */
+void bench_udp(unsigned long frames)
+{
+	struct bench_producer bp = { frames, 0, -1, 0 };
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	struct handler h;
+	pthread_t thread;
+	uint64_t start, last;
+	double cpu;
+	int sock, rcvbuf = 4 << 20;
+
+	sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	bp.sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (sock < 0 || bp.sock < 0) {
+		die("Failed to create socket");
+	}
+	setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0
+		|| getsockname(sock, (struct sockaddr *) &addr, &len) < 0
+		|| connect(bp.sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		die("Failed to set up loopback sockets");
+	}
+	reactor_add(&h, sock, EPOLLIN, bench_udp_event, NULL);
+
+	bench_frames = 0;
+	bench_target = frames;
+	bench_udp_wakeups = 0;
+
+	cpu = bench_cpu();
+	start = last = reactor_now();
+	if (pthread_create(&thread, NULL, bench_udp_producer, &bp) != 0) {
+		die("Unable to start producer");
+	}
+
+	/* datagrams the socket buffer couldn't take are gone, stop once
+	 * the producer is done and nothing came for a while */
+	reactor_running = 1;
+	while (reactor_running) {
+		unsigned long before = bench_frames;
+
+		reactor_poll(100);
+		if (bench_frames != before)
+			last = reactor_now();
+		else if (__atomic_load_n(&bp.done, __ATOMIC_ACQUIRE))
+			break;
+	}
+	bench_transport_report("udp, recv()", frames, last - start, bench_cpu() - cpu,
+						   bench_udp_wakeups);
+	pthread_join(thread, NULL);
+
+	reactor_del(&h);
+	close(sock);
+	close(bp.sock);
+}
+
+/* the server binary, its serial port is a pty we read the frames from */
+struct bench_server {
+	pid_t pid;
+	int master;
+	struct sockaddr_in addr;
+	int netns;			/* the producer sends from here, -1: ours */
+};
+
+/* start server with its UDP port and pty filled in, returns -1 if it
+ * isn't running a moment later */
+int bench_server_start(struct bench_server *s, const char *server, const char **args)
+{
+	char port[16];
+	const char *argv[32];
+	socklen_t len = sizeof(s->addr);
+	int sock, argc = 0, status;
+
+	/* a free port, the server binds it right after */
+	memset(&s->addr, 0, sizeof(s->addr));
+	s->addr.sin_family = AF_INET;
+	s->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (sock < 0 || bind(sock, (struct sockaddr *) &s->addr, sizeof(s->addr)) < 0
+		|| getsockname(sock, (struct sockaddr *) &s->addr, &len) < 0) {
+		die("Failed to find a free port");
+	}
+	close(sock);
+	snprintf(port, sizeof(port), "%u", ntohs(s->addr.sin_port));
+	s->netns = -1;
+
+	s->master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if (s->master < 0 || grantpt(s->master) < 0 || unlockpt(s->master) < 0) {
+		die("Unable to open a pty");
+	}
+
+	argv[argc++] = server;
+	argv[argc++] = "-p";
+	argv[argc++] = port;
+	argv[argc++] = "-s";
+	argv[argc++] = ptsname(s->master);
+	argv[argc++] = "-b";
+	argv[argc++] = "4000000";
+	argv[argc++] = "--silent";
+	while (*args != NULL && argc < 31)
+		argv[argc++] = *args++;
+	argv[argc] = NULL;
+
+	s->pid = fork();
+	if (s->pid < 0) {
+		die("Unable to start the server");
+	}
+	if (s->pid == 0) {
+		int null = open("/dev/null", O_WRONLY);
+
+		if (null >= 0)
+			dup2(null, STDOUT_FILENO);
+		execv(server, (char **)argv);
+		_exit(127);
+	}
+
+	/* it opens the pty and binds the socket before anything else */
+	usleep(300000);
+	if (waitpid(s->pid, &status, WNOHANG) != 0) {
+		printf("%s didn't start\n", server);
+		close(s->master);
+		return -1;
+	}
+	return 0;
+}
+
+/* stop it, ru gets what it used */
+void bench_server_stop(struct bench_server *s, struct rusage *ru)
+{
+	int status;
+
+	kill(s->pid, SIGTERM);
+	wait4(s->pid, &status, 0, ru);
+	close(s->master);
+}
+
+/* user + system CPU seconds in ru */
+double bench_rusage_cpu(struct rusage *ru)
+{
+	return ru->ru_utime.tv_sec + ru->ru_stime.tv_sec
+		   + (ru->ru_utime.tv_usec + ru->ru_stime.tv_usec) / 1e6;
+}
+
+/* datagrams from a producer thread to the server, frames counted as
+ * they come out of the pty; returns ns from the first datagram to the
+ * last frame */
+uint64_t bench_server_load(struct bench_server *s, unsigned long frames)
+{
+	struct bench_producer bp = { frames, 0, -1, 0 };
+	struct pollfd pfd = { s->master, POLLIN, 0 };
+	unsigned char buffer[65536];
+	unsigned long bytes = 0;
+	pthread_t thread;
+	uint64_t start, last;
+	ssize_t n;
+	int self = -1;
+
+	/* a socket belongs to the namespace it was made in, only this
+	 * thread goes there and only for that */
+	if (s->netns >= 0) {
+		self = open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC);
+		if (self < 0 || setns(s->netns, CLONE_NEWNET) < 0) {
+			die("Unable to enter the benchmark's network namespace");
+		}
+	}
+	bp.sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (self >= 0) {
+		if (setns(self, CLONE_NEWNET) < 0) {
+			die("Unable to leave the benchmark's network namespace");
+		}
+		close(self);
+	}
+	if (bp.sock < 0 || connect(bp.sock, (struct sockaddr *) &s->addr, sizeof(s->addr)) < 0) {
+		die("Failed to connect to the server");
+	}
+
+	start = last = reactor_now();
+	if (pthread_create(&thread, NULL, bench_udp_producer, &bp) != 0) {
+		die("Unable to start producer");
+	}
+
+	/* what the socket buffer couldn't take is gone, stop once the
+	 * producer is done and the pty stayed quiet for a while */
+	while (42) {
+		if (poll(&pfd, 1, 200) > 0) {
+			while ((n = read(s->master, buffer, sizeof(buffer))) > 0)
+				bytes += n;
+			last = reactor_now();
+		} else if (__atomic_load_n(&bp.done, __ATOMIC_ACQUIRE)) {
+			break;
+		}
+	}
+	pthread_join(thread, NULL);
+	close(bp.sock);
+
+	bench_frames = bytes / BUFFSIZE;
+	return last - start;
+}
+
+/* AF_XDP needs a real interface: a veth pair, the far end in a
+ * namespace of its own the producer sends from */
+#define BENCH_NETNS "eiwomisarc_bench"
+#define BENCH_VETH "eiwbench0"
+#define BENCH_PEER "eiwbench1"
+#define BENCH_VETH_ADDR "10.254.0.1"
+#define BENCH_PEER_ADDR "10.254.0.2"
+
+void bench_veth_down(void)
+{
+	if (system("ip link del " BENCH_VETH " 2>/dev/null; "
+			   "ip netns del " BENCH_NETNS " 2>/dev/null") != 0)
+		msg_Dbg("veth teardown incomplete");
+}
+
+/* the namespace as an fd for setns(), -1 without CAP_NET_ADMIN or ip(8) */
+int bench_veth_up(void)
+{
+	int fd;
+
+	bench_veth_down();
+	if (system("{ ip netns add " BENCH_NETNS
+			   " && ip link add " BENCH_VETH " type veth peer name " BENCH_PEER
+			   " netns " BENCH_NETNS
+			   " && ip addr add " BENCH_VETH_ADDR "/30 dev " BENCH_VETH
+			   " && ip link set " BENCH_VETH " up"
+			   " && ip -n " BENCH_NETNS " addr add " BENCH_PEER_ADDR "/30 dev " BENCH_PEER
+			   " && ip -n " BENCH_NETNS " link set " BENCH_PEER " up"
+			   " && ip -n " BENCH_NETNS " link set lo up; } 2>/dev/null") != 0
+		|| (fd = open("/run/netns/" BENCH_NETNS, O_RDONLY | O_CLOEXEC)) < 0) {
+		bench_veth_down();
+		return -1;
+	}
+	return fd;
+}
+
+/* one engine row: args for the server, netns/addr where the producer
+ * sends from and to, -1/NULL for loopback */
+void bench_engine_row(const char *server, unsigned long frames, const char *name,
+					  const char **args, int netns, const char *addr)
+{
+	struct bench_server s;
+	struct rusage ru;
+	uint64_t elapsed;
+
+	if (bench_server_start(&s, server, args) < 0)
+		return;
+	s.netns = netns;
+	if (addr != NULL)
+		inet_pton(AF_INET, addr, &s.addr.sin_addr);
+	elapsed = bench_server_load(&s, frames);
+	bench_server_stop(&s, &ru);
+	bench_transport_report(name, frames, elapsed, bench_rusage_cpu(&ru), ru.ru_nvcsw);
+}
+
+/* the receive and write engines end to end, a frame per datagram: what
+ * reaches the pty per second and what the server's CPU time per frame
+ * is; wakeups are the times it went to sleep. AF_XDP runs over a veth
+ * pair, next to recvfrom() over the same pair for comparison */
+void bench_engines(const char *server, unsigned long frames)
+{
+	static const char *engines[][6] = {
+		{ "classic", "--engine", "classic", NULL },
+		{ "classic, --batch 32", "--engine", "classic", "--batch", "32" },
+		{ "io_uring", "--engine", "uring", NULL },
+		{ "io_uring, SQPOLL", "--engine", "uring-sqpoll", NULL },
+	};
+	static const char *veth[][6] = {
+		{ "classic, veth", "--engine", "classic", NULL },
+		{ "AF_XDP, veth", "--engine", "xdp", "--xdp-if", BENCH_VETH },
+	};
+	unsigned int i;
+	int netns;
+
+	for (i = 0; i < sizeof(engines) / sizeof(engines[0]); i++)
+		bench_engine_row(server, frames, engines[i][0], engines[i] + 1, -1, NULL);
+
+	netns = bench_veth_up();
+	if (netns < 0) {
+		printf("AF_XDP: skipped, a veth pair needs CAP_NET_ADMIN and ip(8)\n");
+		return;
+	}
+	for (i = 0; i < sizeof(veth) / sizeof(veth[0]); i++)
+		bench_engine_row(server, frames, veth[i][0], veth[i] + 1, netns, BENCH_VETH_ADDR);
+	close(netns);
+	bench_veth_down();
+}
+
+/* a counter from the server's metrics page, 0 if it isn't there */
+unsigned long bench_metric(const char *path, const char *name)
+{
+	static const char request[] = "GET /metrics HTTP/1.0\r\n\r\n";
+	static char page[65536];
+	struct sockaddr_un addr;
+	size_t len = 0, namelen = strlen(name);
+	char *line;
+	ssize_t n;
+	int sock;
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	if (sock < 0 || connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0
+		|| write(sock, request, sizeof(request) - 1) < 0) {
+		if (sock >= 0)
+			close(sock);
+		return 0;
+	}
+	while (len < sizeof(page) - 1 && (n = read(sock, page + len, sizeof(page) - 1 - len)) > 0)
+		len += n;
+	page[len] = '\0';
+	close(sock);
+
+	for (line = page; line != NULL; line = strchr(line, '\n')) {
+		if (*line == '\n')
+			line++;
+		if (strncmp(line, name, namelen) == 0 && line[namelen] == ' ')
+			return strtoul(line + namelen + 1, NULL, 10);
+	}
+	return 0;
+}
+
+/* receive scaling of --workers: for 1 to maxworkers workers, nproducers
+ * threads flood the port from sockets of their own, so SO_REUSEPORT
+ * spreads them. The workers coalesce per channel, so what counts is what
+ * they received, read from the metrics page, not what reached the pty. */
+void bench_workers(const char *server, unsigned long frames, int maxworkers, int nproducers)
+{
+	struct bench_producer bp[64];
+	pthread_t threads[64];
+	char metrics[64], nwork[16], name[64];
+	const char *args[] = { "--workers", nwork, "--batch", "32", "--metrics", metrics, NULL };
+	int w, i;
+
+	if (nproducers > 64)
+		nproducers = 64;
+	snprintf(metrics, sizeof(metrics), "/tmp/eiwomisarc_bench.%i.metrics", (int)getpid());
+
+	for (w = 1; w <= maxworkers; w++) {
+		struct bench_server s;
+		struct rusage ru;
+		unsigned long received = 0, now_received;
+		uint64_t start, last;
+
+		snprintf(nwork, sizeof(nwork), "%i", w);
+		if (bench_server_start(&s, server, args) < 0)
+			return;
+
+		start = last = reactor_now();
+		for (i = 0; i < nproducers; i++) {
+			bp[i].frames = frames / nproducers;
+			bp[i].noefd = 0;
+			bp[i].done = 0;
+			bp[i].sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+			if (bp[i].sock < 0
+				|| connect(bp[i].sock, (struct sockaddr *) &s.addr, sizeof(s.addr)) < 0) {
+				die("Failed to connect to the server");
+			}
+			if (pthread_create(&threads[i], NULL, bench_udp_producer, &bp[i]) != 0) {
+				die("Unable to start producer");
+			}
+		}
+		for (i = 0; i < nproducers; i++) {
+			pthread_join(threads[i], NULL);
+			close(bp[i].sock);
+		}
+
+		/* the workers are through once the count stops moving; the pty
+		 * isn't read, the port just stays full */
+		while ((now_received = bench_metric(metrics, "eiwomisa_frames_received_total")) != received) {
+			received = now_received;
+			last = reactor_now();
+			usleep(100000);
+		}
+		bench_server_stop(&s, &ru);
+		unlink(metrics);
+
+		bench_frames = received;
+		snprintf(name, sizeof(name), "--workers %i, %i producers", w, nproducers);
+		bench_transport_report(name, frames / nproducers * nproducers, last - start,
+							   bench_rusage_cpu(&ru), ru.ru_nvcsw);
+	}
+}
+
+int main(int argc, char **argv) {
+	struct arg_int *hosts = arg_int0(NULL,"hosts","","allowlist: listed addresses, default: 3000");
+	struct arg_int *prefixes = arg_int0(NULL,"prefixes","","allowlist: listed /24 networks, default: 32");
+	struct arg_int *rounds = arg_int0(NULL,"rounds","","calls per benchmark, default: 10000000");
+	struct arg_int *nframes = arg_int0(NULL,"frames","","shm, udp: frames to send, default: 1000000");
+	struct arg_str *server = arg_str0(NULL,"server","","engines, workers: server binary, default: ./eiwomisarc_server_linux");
+	struct arg_int *maxworkers = arg_int0(NULL,"workers","","workers: run with 1 to n receive workers, default: 4");
+	struct arg_int *producers = arg_int0(NULL,"producers","","workers: threads sending datagrams, default: 4");
+	struct arg_str *names = arg_strn(NULL,NULL,"benchmark",0,16,"allowlist, checkbuffer, shm, udp, engines or workers, default: all");
+
+    struct arg_lit  *help    = arg_lit0("hH","help","print this help and exit");
+    struct arg_lit  *version = arg_lit0(NULL,"version","print version information and exit");
+
+    struct arg_end  *end     = arg_end(20);
+
+    void* argtable[] = {hosts,prefixes,rounds,nframes,server,maxworkers,producers,help,version,names,end};
+
+    int nerrors;
+    int exitcode=0;
+	int i;
+
+    /* verify the argtable[] entries were allocated sucessfully */
+    if (arg_nullcheck(argtable) != 0) {
+        printf("%s: insufficient memory\n",PROGNAME);
+        exitcode=1;
+        goto exit;
+	}
+
+    /* Parse the command line as defined by argtable[] */
+    nerrors = arg_parse(argc,argv,argtable);
+
+    /* special case: '--help' takes precedence over error reporting */
+    if (help->count > 0) {
+		printf("usage: %s", PROGNAME);
+        arg_print_syntax(stdout,argtable,"\n");
+        arg_print_glossary(stdout,argtable,"  %-25s %s\n");
+        exitcode=0;
+        goto exit;
+	}
+
+    /* special case: '--version' takes precedence error reporting */
+    if (version->count > 0) {
+        printf("'%s' version ",PROGNAME);
+		printf("%s",VERSION);
+		printf("\nGIT-REVISION: ");
+		printf("%s",GITREV);
+        printf("\n%s times the hot paths of eiwomisarc_server\n",PROGNAME);
+        printf("%s",COPYRIGHT);
+		printf("\n");
+        exitcode=0;
+        goto exit;
+	}
+
+    /* If the parser returned any errors then display them and exit */
+    if (nerrors > 0) {
+        arg_print_errors(stdout,end,PROGNAME);
+        printf("Try '%s --help' for more information.\n",PROGNAME);
+        exitcode=1;
+        goto exit;
+	}
+
+	int i_hosts = 3000;
+	if(hosts->count>0) {
+		i_hosts = (int)hosts->ival[0];
+	}
+
+	int i_prefixes = 32;
+	if(prefixes->count>0) {
+		i_prefixes = (int)prefixes->ival[0];
+	}
+
+	long i_rounds = 10000000;
+	if(rounds->count>0) {
+		i_rounds = rounds->ival[0];
+	}
+
+	const char *i_server = "./eiwomisarc_server_linux";
+	if(server->count>0) {
+		i_server = server->sval[0];
+	}
+
+	long i_frames = 1000000;
+	if(nframes->count>0) {
+		i_frames = nframes->ival[0];
+	}
+
+	int i_maxworkers = 4;
+	if(maxworkers->count>0) {
+		i_maxworkers = (int)maxworkers->ival[0];
+	}
+
+	int i_producers = 4;
+	if(producers->count>0) {
+		i_producers = (int)producers->ival[0];
+	}
+
+	if (i_maxworkers < 1 || i_maxworkers > 64 || i_producers < 1 || i_producers > 64) {
+		printf("%s: --workers and --producers must be between 1 and 64\n", PROGNAME);
+		exitcode=1;
+		goto exit;
+	}
+
+	if (i_frames < 1) {
+		printf("%s: --frames must be at least 1\n", PROGNAME);
+		exitcode=1;
+		goto exit;
+	}
+
+	if (i_hosts < 0 || i_prefixes < 0 || i_prefixes > 32768 || i_rounds < 1) {
+		printf("%s: --hosts, --prefixes (up to 32768) and --rounds must not be negative\n", PROGNAME);
+		exitcode=1;
+		goto exit;
+	}
+
+	for (i = 0; i < names->count; i++) {
+		int j;
+
+		for (j = 0; benchmarks[j] != NULL && strcmp(names->sval[i], benchmarks[j]) != 0; j++)
+			;
+		if (benchmarks[j] == NULL) {
+			printf("%s: unknown benchmark '%s'\n", PROGNAME, names->sval[i]);
+			exitcode=1;
+			goto exit;
+		}
+	}
+
+	if (bench_wanted(names, "allowlist")) {
+		bench_allowlist(i_hosts, i_prefixes, i_rounds);
+	}
+	if (bench_wanted(names, "checkbuffer")) {
+		bench_checkbuffer(i_rounds);
+	}
+
+	/* the transports run in an event loop like the server's */
+	if (bench_wanted(names, "shm") || bench_wanted(names, "udp") || bench_wanted(names, "engines")
+		|| bench_wanted(names, "workers")) {
+		msglevel = 1;
+		reactor_init();
+	}
+	if (bench_wanted(names, "shm")) {
+		bench_shm(i_frames, 0);
+		bench_shm(i_frames, 1);
+	}
+	if (bench_wanted(names, "udp")) {
+		bench_udp(i_frames);
+	}
+	if (bench_wanted(names, "engines")) {
+		bench_engines(i_server, i_frames);
+	}
+	if (bench_wanted(names, "workers")) {
+		bench_workers(i_server, i_frames, i_maxworkers, i_producers);
+	}
+
+exit:
+    /* deallocate each non-null entry in argtable[] */
+    arg_freetable(argtable,sizeof(argtable)/sizeof(argtable[0]));
+
+    return exitcode;
+}
@@ -0,0 +1,140 @@
+/*****************************************************************************
+ * chantable.h: latest value per channel, shared between threads
+ *****************************************************************************
+ * Copyright (C) 2011 Kai Hermann
+ *
+ * Authors: Kai Hermann <kai.uwe.hermann at gmail dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/* The coalescer for several receive workers: any number of threads put
+ * values, one consumer (the port's writer) takes them. A put is an
+ * atomic store of the value followed by setting the channel's bit in a
+ * dirty bitmap, so the newest value of a channel always wins and nobody
+ * takes a lock. The consumer clears a bit before it reads the value; a
+ * value stored after that sets the bit again and is sent again.
+ *
+ * pending counts dirty channels. Whoever moves it away from 0 writes the
+ * eventfd, so the consumer only has to be woken when it ran dry. It can
+ * be off by one for a moment while a put races with a take. */
+
+#include <sys/eventfd.h>
+
+struct chantable {
+	unsigned short *value;
+	uint64_t *dirty;
+	unsigned int first, size, words;
+	unsigned int cursor;	/* consumer: next bitmap word and bit to look at */
+	unsigned int cursor_bit;
+	int pending;
+	int efd;
+	uint64_t *since;	/* --latency: when a channel went dirty, or NULL */
+};
+
+void chantable_init(struct chantable *t, unsigned int first, unsigned int size)
+{
+	t->first = first;
+	t->size = size;
+	t->words = (size + 63) / 64;
+	t->value = calloc(size, sizeof(unsigned short));
+	t->dirty = calloc(t->words, sizeof(uint64_t));
+	if (t->value == NULL || t->dirty == NULL) {
+		die("Unable to allocate channel table");
+	}
+	t->cursor = t->cursor_bit = 0;
+	t->pending = 0;
+	t->since = NULL;
+	t->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (t->efd < 0) {
+		die("Failed to create eventfd");
+	}
+}
+
+/* also keep when each channel went dirty, see --latency */
+void chantable_track(struct chantable *t)
+{
+	t->since = calloc(t->size, sizeof(uint64_t));
+	if (t->since == NULL) {
+		die("Unable to allocate channel table");
+	}
+}
+
+/* any thread: store a validated frame, returns 1 if it replaced a
+ * value that wasn't sent yet */
+int chantable_put(struct chantable *t, const unsigned char *buffer, uint64_t stamp)
+{
+	unsigned int channel = frame_channel(buffer) - t->first;
+	uint64_t bit = 1ULL << (channel & 63);
+	uint64_t one = 1;
+
+	__atomic_store_n(&t->value[channel], frame_value(buffer), __ATOMIC_RELAXED);
+	if (__atomic_fetch_or(&t->dirty[channel / 64], bit, __ATOMIC_RELEASE) & bit)
+		return 1;
+
+	/* may land just after the consumer took the value, the stamp is
+	 * only used for statistics */
+	if (t->since != NULL)
+		__atomic_store_n(&t->since[channel], stamp, __ATOMIC_RELAXED);
+
+	if (__atomic_fetch_add(&t->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+		if (write(t->efd, &one, sizeof(one)) < 0)
+			msg_Dbg("Unable to wake serial writer");
+	}
+	return 0;
+}
+
+/* consumer: take a dirty channel, returns 0 if there is none;
+ * *stamp is when it went dirty, if tracked */
+int chantable_get(struct chantable *t, unsigned char *buffer, uint64_t *stamp)
+{
+	unsigned int i, channel;
+	uint64_t word, bit;
+
+	if (__atomic_load_n(&t->pending, __ATOMIC_ACQUIRE) <= 0)
+		return 0;
+
+	/* round robin over the channels, a busy one can't starve the rest;
+	 * one more word than there are covers the start of the first one */
+	for (i = 0; i <= t->words; i++) {
+		word = __atomic_load_n(&t->dirty[t->cursor], __ATOMIC_RELAXED)
+			   & (~0ULL << t->cursor_bit);
+		if (word != 0) {
+			bit = word & -word;
+			__atomic_fetch_and(&t->dirty[t->cursor], ~bit, __ATOMIC_ACQUIRE);
+			__atomic_fetch_sub(&t->pending, 1, __ATOMIC_RELEASE);
+			channel = t->cursor * 64 + __builtin_ctzll(word);
+			frame_build(buffer, t->first + channel,
+						__atomic_load_n(&t->value[channel], __ATOMIC_RELAXED));
+			*stamp = t->since != NULL
+				? __atomic_load_n(&t->since[channel], __ATOMIC_RELAXED) : 0;
+			t->cursor_bit = __builtin_ctzll(word) + 1;
+			if (t->cursor_bit < 64)
+				return 1;
+		}
+		t->cursor_bit = 0;
+		t->cursor = (t->cursor + 1 == t->words) ? 0 : t->cursor + 1;
+		if (word != 0)
+			return 1;
+	}
+	return 0;
+}
+
+unsigned int chantable_pending(struct chantable *t)
+{
+	int pending = __atomic_load_n(&t->pending, __ATOMIC_RELAXED);
+
+	return pending > 0 ? pending : 0;
+}
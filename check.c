@@ -0,0 +1,218 @@
+/*****************************************************************************
+ * check: self checks of the server's queues and serial port specs
+ *****************************************************************************
+ * Copyright (C) 2011 Kai Hermann
+ *
+ * Authors: Kai Hermann <kai.uwe.hermann at gmail dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/* Drives the queues of the server without a port or a loop and checks
+ * what must always hold. Prints every failed check, exits with 1 if
+ * there was one. Build with the same CFLAGS as the server, "make check". */
+
+#define _GNU_SOURCE
+
+#define BUFFSIZE 6
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+/* message functions */
+#include "messages.h"
+
+/* runtime counters */
+#include "stats.h"
+
+/* event loop */
+#include "reactor.h"
+
+/* latency histograms */
+#include "latency.h"
+
+/* the queues in front of a port */
+#include "coalesce.h"
+#include "chantable.h"
+#include "spsc.h"
+#include "drr.h"
+
+/* RS-232 port handling */
+#include "serial.h"
+
+/* stats_print() reports these, none of them runs here */
+void worker_print_stats(void) {}
+void shmingest_print_stats(void) {}
+void tcp_print_stats(void) {}
+
+int failed = 0;
+
+#define check(cond) \
+	do { \
+		if (!(cond)) { \
+			printf("%s:%i: %s failed\n", __func__, __LINE__, #cond); \
+			failed = 1; \
+		} \
+	} while (0)
+
+/* the ring holds what its counters say, and the head frame is untouched */
+void check_ring(struct serialport *sp, const unsigned char *head)
+{
+	unsigned int slot, dead = 0;
+
+	check(sp->tail - sp->head <= sp->mask + 1);
+	for (slot = sp->head; slot != sp->tail && slot - sp->head <= sp->mask; slot++)
+		dead += serial_dead(sp, slot);
+	check(dead == sp->dead);
+	check(memcmp(serial_frame(sp, 0), head, BUFFSIZE) == 0);
+}
+
+/* --drop oldest while the head frame is half way out: the tombstones
+ * after it can't be stepped over, the ring must still not wrap onto it */
+void check_drop_oldest_partial(unsigned int highwater)
+{
+	struct serialport sp;
+	unsigned char frame[BUFFSIZE], head[BUFFSIZE];
+	unsigned int i;
+
+	memset(&sp, 0, sizeof(sp));
+	sp.fd = -1;
+	serial_init_queue(&sp, 8, highwater, DROP_OLDEST);
+
+	frame_build(frame, 0, 0);
+	serial_queue_frame(&sp, frame, 0, 0);
+	memcpy(head, frame, BUFFSIZE);
+	sp.offset = 3;
+
+	for (i = 1; i < 100; i++) {
+		frame_build(frame, i, i % 510);
+		serial_queue_frame(&sp, frame, 0, 0);
+		check_ring(&sp, head);
+	}
+	check(serial_queued(&sp) <= sp.highwater);
+
+	/* the head is out, the tombstones behind it go with it */
+	serial_advance(&sp);
+	check(serial_queued(&sp) == sp.tail - sp.head);
+	check(sp.dead == 0);
+
+	free(sp.queue);
+}
+
+/* the same with the first frames handed to the kernel (io_uring) */
+void check_drop_oldest_pinned(void)
+{
+	struct serialport sp;
+	unsigned char frame[BUFFSIZE], head[BUFFSIZE];
+	unsigned int i;
+
+	memset(&sp, 0, sizeof(sp));
+	sp.fd = -1;
+	serial_init_queue(&sp, 8, 0, DROP_OLDEST);
+
+	for (i = 0; i < 3; i++) {
+		frame_build(frame, i, 1);
+		serial_queue_frame(&sp, frame, 0, 0);
+	}
+	memcpy(head, serial_frame(&sp, 0), BUFFSIZE);
+	sp.pinned = 3;
+	sp.pin_end = sp.head + 3;
+
+	for (i = 3; i < 100; i++) {
+		frame_build(frame, i, i % 510);
+		serial_queue_frame(&sp, frame, 0, 0);
+		check_ring(&sp, head);
+	}
+	/* the pinned ones are never dropped */
+	for (i = 0; i < 3; i++)
+		check(frame_channel(serial_frame(&sp, i)) == i);
+
+	free(sp.queue);
+}
+
+/* one --serial spec on its own, what serial_add_spec() made of it */
+void check_spec(const char *spec, const char *error, const char *path, int baud,
+				int lo, int hi)
+{
+	const char *got;
+
+	nports = 0;
+	serial_default = NULL;
+	got = serial_add_spec(spec);
+	if (error != NULL) {
+		check(got != NULL && strcmp(got, error) == 0);
+		check(nports == 0);
+		return;
+	}
+	check(got == NULL);
+	if (got != NULL)
+		return;
+	check(strcmp(ports[0].path, path) == 0);
+	check(ports[0].baud == baud);
+	check(ports[0].ranged == (lo >= 0));
+	if (lo >= 0)
+		check(ports[0].lo == (unsigned int)lo && ports[0].hi == (unsigned int)hi);
+	free(ports[0].path);
+}
+
+/* colons in by-path names are part of the path */
+void check_specs(void)
+{
+	static const char usb[] = "/dev/serial/by-path/pci-0000:00:14.0-usb-0:1:1.0-port0";
+	char spec[128];
+
+	check_spec("/dev/ttyS0", NULL, "/dev/ttyS0", -1, -1, 0);
+	check_spec("/dev/ttyS0:9600", NULL, "/dev/ttyS0", 9600, -1, 0);
+	check_spec("/dev/ttyS0:9600:0-99", NULL, "/dev/ttyS0", 9600, 0, 99);
+	check_spec("/dev/ttyS0::100-199", NULL, "/dev/ttyS0", -1, 100, 199);
+	check_spec("/dev/ttyS0:0", "invalid baudrate", NULL, 0, 0, 0);
+	check_spec("/dev/ttyS0:9600:5-2", "channel range out of bounds", NULL, 0, 0, 0);
+	check_spec(":9600", "missing device", NULL, 0, 0, 0);
+
+	check_spec(usb, NULL, usb, -1, -1, 0);
+	snprintf(spec, sizeof(spec), "%s:115200", usb);
+	check_spec(spec, NULL, usb, 115200, -1, 0);
+	snprintf(spec, sizeof(spec), "%s:115200:0-255", usb);
+	check_spec(spec, NULL, usb, 115200, 0, 255);
+	snprintf(spec, sizeof(spec), "%s::0-255", usb);
+	check_spec(spec, NULL, usb, -1, 0, 255);
+
+	nports = 0;
+	serial_default = NULL;
+}
+
+int main(int argc, char **argv)
+{
+	msglevel = 0;
+
+	check_drop_oldest_partial(0);
+	check_drop_oldest_partial(4);
+	check_drop_oldest_pinned();
+	check_specs();
+
+	if (!failed)
+		printf("all checks passed\n");
+	return failed;
+}
@@ -0,0 +1,128 @@
+/*****************************************************************************
+ * coalesce.h: keep only the latest value per channel
+ *****************************************************************************
+ * Copyright (C) 2011 Kai Hermann
+ *
+ * Authors: Kai Hermann <kai.uwe.hermann at gmail dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/* A frame is 255, value (2 bytes), channel (3 bytes). Every byte after the
+ * start byte is < 255, so value and channel are base-255 numbers:
+ *   value   = buffer[1] + 255 * buffer[2]                      (0..509)
+ *   channel = buffer[3] + 255 * buffer[4] + 255*255 * buffer[5] (0..325124)
+ * The link is much slower than the faders, so instead of queueing every
+ * frame we remember the newest value of each channel and a list of
+ * channels that changed since they were last sent. */
+
+#define CHANNELS (255 * 255 * 5)
+
+unsigned int frame_channel(const unsigned char *buffer)
+{
+	return buffer[3] + 255 * buffer[4] + 255 * 255 * buffer[5];
+}
+
+unsigned int frame_value(const unsigned char *buffer)
+{
+	return buffer[1] + 255 * buffer[2];
+}
+
+/* build a frame from channel and value */
+void frame_build(unsigned char *buffer, unsigned int channel, unsigned int value)
+{
+	buffer[0] = 255;
+	buffer[1] = value % 255;
+	buffer[2] = value / 255;
+	buffer[3] = channel % 255;
+	buffer[4] = (channel / 255) % 255;
+	buffer[5] = channel / (255 * 255);
+}
+
+/* the tables cover the channels first..first+size-1, one port's range */
+struct coalescer {
+	unsigned short *value;	/* latest value per channel */
+	unsigned char *dirty;	/* channel is waiting in list */
+	unsigned int *list;	/* ring of dirty channels, oldest first */
+	unsigned int head;	/* index of the oldest entry in list */
+	unsigned int count;	/* entries in list, never more than size */
+	unsigned int first;
+	unsigned int size;
+	uint64_t *since;	/* --latency: stamp of the oldest unsent value, or NULL */
+};
+
+void coalesce_init(struct coalescer *co, unsigned int first, unsigned int size)
+{
+	co->value = calloc(size, sizeof(unsigned short));
+	co->dirty = calloc(size, sizeof(unsigned char));
+	co->list = calloc(size, sizeof(unsigned int));
+	co->head = co->count = 0;
+	co->first = first;
+	co->size = size;
+	co->since = NULL;
+
+	if (co->value == NULL || co->dirty == NULL || co->list == NULL) {
+		die("Unable to allocate channel table");
+	}
+}
+
+/* also keep when each channel went dirty, see --latency */
+void coalesce_track(struct coalescer *co)
+{
+	co->since = calloc(co->size, sizeof(uint64_t));
+	if (co->since == NULL) {
+		die("Unable to allocate channel table");
+	}
+}
+
+/* remember a validated frame, returns 1 if it replaced a pending value */
+int coalesce_put(struct coalescer *co, const unsigned char *buffer, uint64_t stamp)
+{
+	unsigned int channel = frame_channel(buffer) - co->first;
+
+	co->value[channel] = frame_value(buffer);
+	if (co->dirty[channel])
+		return 1;
+
+	co->dirty[channel] = 1;
+	if (co->since != NULL)
+		co->since[channel] = stamp;
+	co->list[(co->head + co->count) % co->size] = channel;
+	co->count++;
+	return 0;
+}
+
+/* take the oldest dirty channel, returns 0 if nothing changed;
+ * *stamp is when it went dirty, if tracked */
+int coalesce_get(struct coalescer *co, unsigned char *buffer, uint64_t *stamp)
+{
+	unsigned int channel;
+
+	if (co->count == 0)
+		return 0;
+
+	channel = co->list[co->head];
+	co->head = (co->head + 1) % co->size;
+	co->count--;
+	co->dirty[channel] = 0;
+	frame_build(buffer, co->first + channel, co->value[channel]);
+	*stamp = co->since != NULL ? co->since[channel] : 0;
+	return 1;
+}
+
+unsigned int coalesce_pending(struct coalescer *co)
+{
+	return __atomic_load_n(&co->count, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,267 @@
+/*****************************************************************************
+ * drr.h: fair share of the link per client
+ *****************************************************************************
+ * Copyright (C) 2011 Kai Hermann
+ *
+ * Authors: Kai Hermann <kai.uwe.hermann at gmail dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/* Deficit round robin over one queue per client. Active clients take
+ * turns; in its turn a client sends up to its weight in frames (all
+ * frames are the same size, so the deficit counts frames). Whoever sends
+ * faster only fills its own queue. The port pulls from here one burst at
+ * a time, like from the coalescer.
+ *
+ * With a writer thread the thread owns everything here; the counters
+ * drr_print() reads from the main thread are stored atomically. */
+
+#define DRR_FLOWS 256		/* clients per port, power of 2 */
+#define DRR_FLOWLEN 64		/* default frames queued per client */
+#define DRR_MAXFLOWLEN 4096	/* --queue limit with --fair, there are DRR_FLOWS of them */
+#define DRR_PROBE 8		/* slots looked at per lookup */
+#define DRR_NONE UINT_MAX
+
+/* --weight, looked up when a client gets its queue */
+#define DRR_MAXWEIGHTS 64
+
+struct drr_weight {
+	in_addr_t addr;
+	int weight;
+};
+
+struct drr_weight drr_weights[DRR_MAXWEIGHTS];
+int drr_nweights = 0;
+
+struct drr_flow {
+	in_addr_t addr;		/* 0 = free */
+	int weight;
+	int deficit;		/* frames left in the current turn */
+	unsigned int head, tail;
+	unsigned int next;	/* active list */
+	int active;
+
+	unsigned long sent;
+	uint64_t wait_sum_ns, wait_max_ns;
+};
+
+struct drr {
+	struct drr_flow *flows;
+	unsigned char (*frames)[BUFFSIZE];	/* flowlen per flow */
+	uint64_t *queued_ns;			/* arrival time of each frame */
+	unsigned int flowlen;			/* power of 2 */
+	unsigned int highwater;			/* apply the drop policy at this many frames */
+	unsigned int first, last;		/* active list, DRR_NONE if empty */
+	unsigned int pending;			/* frames in all queues */
+	uint64_t got_ns;			/* arrival time of the frame drr_get() took */
+	int drop_oldest;			/* full queue: drop its oldest frame, not the new one */
+};
+
+/* length and highwater are per client, like --queue and --highwater are
+ * for the whole port without --fair */
+void drr_init(struct drr *d, unsigned int length, unsigned int highwater, int drop_oldest)
+{
+	unsigned int size = 1;
+
+	while (size < length)
+		size <<= 1;
+
+	d->flows = calloc(DRR_FLOWS, sizeof(struct drr_flow));
+	d->frames = calloc((size_t)DRR_FLOWS * size, BUFFSIZE);
+	d->queued_ns = calloc((size_t)DRR_FLOWS * size, sizeof(uint64_t));
+	if (d->flows == NULL || d->frames == NULL || d->queued_ns == NULL) {
+		die("Unable to allocate client queues");
+	}
+	d->flowlen = size;
+	d->highwater = (highwater > 0 && highwater < size) ? highwater : size;
+	d->first = d->last = DRR_NONE;
+	d->pending = 0;
+	d->drop_oldest = drop_oldest;
+}
+
+int drr_weight_of(in_addr_t addr)
+{
+	int i;
+
+	for (i = 0; i < drr_nweights; i++) {
+		if (drr_weights[i].addr == addr)
+			return drr_weights[i].weight;
+	}
+	return 1;
+}
+
+/* queue of a client, an idle client gives up its slot to a new one
+ * returns NULL if every nearby slot has frames waiting */
+struct drr_flow *drr_find(struct drr *d, in_addr_t addr)
+{
+	unsigned int i, slot = (addr * 2654435769U) >> 16;
+	struct drr_flow *f, *idle = NULL;
+
+	for (i = 0; i < DRR_PROBE; i++) {
+		f = &d->flows[(slot + i) & (DRR_FLOWS - 1)];
+		if (f->addr == addr)
+			return f;
+		if (idle == NULL && f->head == f->tail)
+			idle = f;
+	}
+
+	if (idle != NULL) {
+		__atomic_store_n(&idle->addr, addr, __ATOMIC_RELAXED);
+		__atomic_store_n(&idle->weight, drr_weight_of(addr), __ATOMIC_RELAXED);
+		__atomic_store_n(&idle->sent, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&idle->wait_sum_ns, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&idle->wait_max_ns, 0, __ATOMIC_RELAXED);
+		idle->deficit = 0;
+		idle->next = 0;
+		idle->active = 0;
+	}
+	return idle;
+}
+
+unsigned int drr_index(struct drr *d, struct drr_flow *f)
+{
+	return f - d->flows;
+}
+
+/* index of a client's i-th frame in frames and queued_ns */
+size_t drr_slot(struct drr *d, struct drr_flow *f, unsigned int i)
+{
+	return (size_t)drr_index(d, f) * d->flowlen + (i & (d->flowlen - 1));
+}
+
+unsigned char *drr_frame(struct drr *d, struct drr_flow *f, unsigned int i)
+{
+	return d->frames[drr_slot(d, f, i)];
+}
+
+/* queue a frame from addr
+ * returns 1 if queued, 0 if dropped, 2 if queued after dropping the
+ * client's oldest frame */
+int drr_put(struct drr *d, const unsigned char *buffer, in_addr_t addr, uint64_t now)
+{
+	struct drr_flow *f = drr_find(d, addr);
+	size_t idx;
+	int ret = 1;
+
+	if (f == NULL)
+		return 0;
+
+	if (f->tail - f->head >= d->highwater) {
+		if (!d->drop_oldest)
+			return 0;
+		__atomic_store_n(&f->head, f->head + 1, __ATOMIC_RELAXED);
+		d->pending--;
+		ret = 2;
+	}
+
+	idx = drr_slot(d, f, f->tail);
+	memcpy(d->frames[idx], buffer, BUFFSIZE);
+	d->queued_ns[idx] = now;
+	__atomic_store_n(&f->tail, f->tail + 1, __ATOMIC_RELAXED);
+	d->pending++;
+
+	if (!f->active) {
+		f->active = 1;
+		f->deficit = 0;
+		f->next = DRR_NONE;
+		if (d->last == DRR_NONE)
+			d->first = drr_index(d, f);
+		else
+			d->flows[d->last].next = drr_index(d, f);
+		d->last = drr_index(d, f);
+	}
+	return ret;
+}
+
+/* next frame in round robin order, returns 0 if all queues are empty */
+int drr_get(struct drr *d, unsigned char *buffer, uint64_t now)
+{
+	struct drr_flow *f;
+	size_t idx;
+	uint64_t wait;
+
+	if (d->first == DRR_NONE)
+		return 0;
+
+	f = &d->flows[d->first];
+	if (f->deficit == 0)
+		f->deficit = f->weight;	/* its turn starts */
+
+	idx = drr_slot(d, f, f->head);
+	memcpy(buffer, d->frames[idx], BUFFSIZE);
+	d->got_ns = d->queued_ns[idx];
+	wait = now - d->queued_ns[idx];
+	__atomic_store_n(&f->wait_sum_ns, f->wait_sum_ns + wait, __ATOMIC_RELAXED);
+	if (wait > f->wait_max_ns)
+		__atomic_store_n(&f->wait_max_ns, wait, __ATOMIC_RELAXED);
+	__atomic_store_n(&f->sent, f->sent + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&f->head, f->head + 1, __ATOMIC_RELAXED);
+	f->deficit--;
+	d->pending--;
+
+	if (f->head == f->tail || f->deficit == 0) {
+		/* turn over: leave the list, or go to its end */
+		d->first = f->next;
+		if (d->first == DRR_NONE)
+			d->last = DRR_NONE;
+		if (f->head == f->tail) {
+			f->active = 0;
+			f->deficit = 0;
+		} else {
+			f->next = DRR_NONE;
+			if (d->last == DRR_NONE)
+				d->first = drr_index(d, f);
+			else
+				d->flows[d->last].next = drr_index(d, f);
+			d->last = drr_index(d, f);
+		}
+	}
+	return 1;
+}
+
+unsigned int drr_pending(struct drr *d)
+{
+	return __atomic_load_n(&d->pending, __ATOMIC_RELAXED);
+}
+
+/* queue depth and wait time of every client that sent something
+ * A slot the writer thread hands to a new client meanwhile can mix two
+ * clients' numbers in one line, that's all. */
+void drr_print(struct drr *d, const char *path)
+{
+	char ip[INET_ADDRSTRLEN];
+	unsigned int i;
+
+	for (i = 0; i < DRR_FLOWS; i++) {
+		struct drr_flow *f = &d->flows[i];
+		in_addr_t addr = __atomic_load_n(&f->addr, __ATOMIC_RELAXED);
+		unsigned int head, tail;
+		unsigned long sent;
+		uint64_t wait_sum, wait_max;
+
+		if (addr == 0)
+			continue;
+		head = __atomic_load_n(&f->head, __ATOMIC_RELAXED);
+		tail = __atomic_load_n(&f->tail, __ATOMIC_RELAXED);
+		sent = __atomic_load_n(&f->sent, __ATOMIC_RELAXED);
+		wait_sum = __atomic_load_n(&f->wait_sum_ns, __ATOMIC_RELAXED);
+		wait_max = __atomic_load_n(&f->wait_max_ns, __ATOMIC_RELAXED);
+		inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+		msg_Info("stats: %s client %s (weight %i): %u queued, %lu sent, wait avg %.2f ms, max %.2f ms",
+				 path, ip, __atomic_load_n(&f->weight, __ATOMIC_RELAXED), tail - head, sent,
+				 sent ? wait_sum / 1e6 / sent : 0.0, wait_max / 1e6);
+	}
+}
@@ -0,0 +1,476 @@
+/*****************************************************************************
+ * emulator: EIWOMISA controller on a pseudo terminal
+ *****************************************************************************
+ * Copyright (C) 2011 Kai Hermann
+ *
+ * Authors: Kai Hermann <kai.uwe.hermann at gmail dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/* Stands in for the controller: creates a pty pair, optionally starts the
+ * server with --serial set to the slave side and takes bytes from the
+ * master side no faster than the baud rate would carry them, a 16 byte
+ * UART FIFO at a time. Whatever the server writes faster piles up in the
+ * tty, as it would on a real port. Frames are checked with the rules of
+ * checkbuffer() and applied to a table of channel values.
+ *
+ * The emulator keeps a wire clock: every byte takes byte_ns, a byte that
+ * finds the wire idle starts when it is read. The idle time between the
+ * end of one frame and the start of the next is the inter-frame gap; it
+ * is 0 while the server keeps the link busy. */
+
+#define _GNU_SOURCE /* ptsname_r() */
+
+#include "git_rev.h"
+
+#define VERSION "0.4"
+#define PROGNAME "eiwomisarc_emulator"
+#define COPYRIGHT "2009-2011, Kai Hermann"
+#define BUFFSIZE 6
+#define UART_FIFO 16	/* bytes taken per read, like a 16550 */
+#define BITS_PER_BYTE 10	/* start + 8 data + stop */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <termios.h>
+#include <sys/wait.h>
+
+/* message functions */
+#include "messages.h"
+
+/* argtable */
+#include "argtable2/argtable2.h"
+
+/* event loop */
+#include "reactor.h"
+
+/* frame_channel(), frame_value(), CHANNELS */
+#include "coalesce.h"
+
+/* checkbuffer(), what the server lets through */
+#include "frame.h"
+
+struct emulator {
+	int master, slave;
+	char path[64];
+	uint64_t byte_ns;
+	uint64_t wire_ns;		/* the wire is free from then on */
+	int waiting;			/* bytes wait for the wire, EPOLLIN is off until wire_ns */
+	pid_t child;			/* server we started, 0 = none */
+	int status;			/* its exit status */
+
+	unsigned char frame[BUFFSIZE];	/* frame being received */
+	unsigned int have;		/* bytes of it */
+	uint64_t frame_end_ns;		/* wire time the last frame ended, 0 = none yet */
+	unsigned short *state;		/* value per channel */
+
+	struct handler h, timer_h, stats_h, signal_h;
+
+	/* since the last report */
+	unsigned long bytes, frames, malformed, garbage, gaps;
+	uint64_t gap_sum_ns, gap_max_ns;
+	uint64_t last_report_ns;
+
+	/* whole run */
+	unsigned long total_frames, total_malformed, total_garbage;
+};
+
+struct emulator emu;
+
+/* a complete frame left the wire */
+void emu_frame(struct emulator *e)
+{
+	e->frames++;
+	e->total_frames++;
+
+	if (checkbuffer(e->frame) != 0) {
+		e->malformed++;
+		e->total_malformed++;
+		msg_Dbg("malformed frame %02x %02x %02x %02x %02x %02x", e->frame[0], e->frame[1],
+				e->frame[2], e->frame[3], e->frame[4], e->frame[5]);
+		return;
+	}
+
+	e->state[frame_channel(e->frame)] = frame_value(e->frame);
+	msg_Dbg("channel %u = %u", frame_channel(e->frame), frame_value(e->frame));
+}
+
+/* one byte on the wire at t */
+void emu_byte(struct emulator *e, unsigned char c, uint64_t t)
+{
+	if (c == 255) {
+		/* a start byte, whatever we had was cut short */
+		if (e->have > 0) {
+			e->malformed++;
+			e->total_malformed++;
+			msg_Dbg("frame cut short after %u bytes", e->have);
+		}
+		if (e->frame_end_ns != 0) {
+			uint64_t gap = t - e->frame_end_ns;
+
+			e->gaps++;
+			e->gap_sum_ns += gap;
+			if (gap > e->gap_max_ns)
+				e->gap_max_ns = gap;
+		}
+		e->frame[0] = c;
+		e->have = 1;
+		return;
+	}
+
+	if (e->have == 0) {
+		/* not inside a frame, the controller skips to the next 255 */
+		e->garbage++;
+		e->total_garbage++;
+		return;
+	}
+
+	e->frame[e->have++] = c;
+	if (e->have == BUFFSIZE) {
+		e->have = 0;
+		e->frame_end_ns = t + e->byte_ns;
+		emu_frame(e);
+	}
+}
+
+/* take one FIFO worth if the wire is free, else wait until it is */
+void emu_read(struct emulator *e)
+{
+	unsigned char buf[UART_FIFO];
+	uint64_t now = reactor_now(), t;
+	int n, i;
+
+	if (e->wire_ns > now) {
+		reactor_mod(&e->h, 0);
+		reactor_arm_timer(&e->timer_h, e->wire_ns);
+		e->waiting = 1;
+		return;
+	}
+
+	n = read(e->master, buf, sizeof(buf));
+	if (n < 0) {
+		/* EIO: nobody has the slave open, we keep our own fd so that
+		 * only happens while closing */
+		if (errno != EAGAIN && errno != EINTR && errno != EIO)
+			msg_Err("reading the pty failed: %s", strerror(errno));
+		return;
+	}
+
+	/* bytes that were queued while the wire was busy follow right
+	 * behind, however late the timer woke us; an idle wire doesn't
+	 * save up time */
+	t = e->waiting || e->wire_ns > now ? e->wire_ns : now;
+	e->waiting = 0;
+	for (i = 0; i < n; i++) {
+		emu_byte(e, buf[i], t);
+		t += e->byte_ns;
+	}
+	e->wire_ns = t;
+	e->bytes += n;
+}
+
+void emu_event(struct handler *h, unsigned int events)
+{
+	emu_read(h->arg);
+}
+
+void emu_timer_event(struct handler *h, unsigned int events)
+{
+	struct emulator *e = h->arg;
+
+	reactor_timer_ack(h);
+	reactor_mod(&e->h, EPOLLIN);
+}
+
+void emu_print_stats(struct emulator *e)
+{
+	uint64_t now = reactor_now();
+	double elapsed = (now - e->last_report_ns) / 1e9;
+	double capacity = 1e9 / (e->byte_ns * BUFFSIZE);
+
+	if (elapsed <= 0)
+		return;
+
+	msg_Info("stats: %lu frames, %.1f frames/s of %.1f (%.1f%% utilisation)",
+			 e->frames, e->frames / elapsed, capacity,
+			 100.0 * e->bytes * e->byte_ns / (elapsed * 1e9));
+	msg_Info("stats: inter-frame gap avg %.3f ms, max %.3f ms",
+			 e->gaps > 0 ? e->gap_sum_ns / 1e6 / e->gaps : 0.0, e->gap_max_ns / 1e6);
+	msg_Info("stats: %lu malformed frames, %lu stray bytes", e->malformed, e->garbage);
+
+	e->bytes = e->frames = e->malformed = e->garbage = e->gaps = 0;
+	e->gap_sum_ns = e->gap_max_ns = 0;
+	e->last_report_ns = now;
+}
+
+void emu_stats_event(struct handler *h, unsigned int events)
+{
+	if (reactor_timer_ack(h) > 0)
+		emu_print_stats(h->arg);
+}
+
+/* SIGINT/SIGTERM stop, SIGCHLD stops when our server is gone */
+void emu_signal_event(struct handler *h, unsigned int events)
+{
+	struct emulator *e = h->arg;
+	struct signalfd_siginfo si;
+
+	while (read(h->fd, &si, sizeof(si)) == sizeof(si)) {
+		if (si.ssi_signo != SIGCHLD) {
+			reactor_running = 0;
+		} else if (e->child > 0 && waitpid(e->child, &e->status, WNOHANG) == e->child) {
+			msg_Info("server exited");
+			e->child = 0;
+			reactor_running = 0;
+		}
+	}
+}
+
+/* create the pty pair, the slave stays open so the master never sees a hangup */
+void emu_open_pty(struct emulator *e)
+{
+	struct termios tio;
+
+	e->master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if (e->master < 0 || grantpt(e->master) < 0 || unlockpt(e->master) < 0
+		|| ptsname_r(e->master, e->path, sizeof(e->path)) != 0) {
+		die("Unable to create pseudo terminal");
+	}
+
+	e->slave = open(e->path, O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (e->slave < 0) {
+		die("Unable to open pseudo terminal");
+	}
+
+	/* raw until the server sets it up, nothing may touch the bytes */
+	if (tcgetattr(e->slave, &tio) == 0) {
+		cfmakeraw(&tio);
+		tcsetattr(e->slave, TCSANOW, &tio);
+	}
+}
+
+/* run argv with --serial (and --baud, unless given) pointing at us */
+pid_t emu_spawn(struct emulator *e, const char **args, int nargs, int baud)
+{
+	char **argv = calloc(nargs + 5, sizeof(char *));
+	char baudstr[16];
+	int i, n = 0, hasbaud = 0;
+	pid_t pid;
+
+	if (argv == NULL) {
+		die("Unable to allocate arguments");
+	}
+	for (i = 0; i < nargs; i++) {
+		if (strcmp(args[i], "-b") == 0 || strcmp(args[i], "-B") == 0
+			|| strncmp(args[i], "--baud", 6) == 0)
+			hasbaud = 1;
+		argv[n++] = (char *)args[i];
+	}
+	argv[n++] = "--serial";
+	argv[n++] = e->path;
+	if (!hasbaud) {
+		snprintf(baudstr, sizeof(baudstr), "%i", baud);
+		argv[n++] = "--baud";
+		argv[n++] = baudstr;
+	}
+	argv[n] = NULL;
+
+	pid = fork();
+	if (pid < 0) {
+		die("Unable to start the server");
+	}
+	if (pid == 0) {
+		sigset_t none;
+
+		/* the signals were blocked for our signalfd */
+		sigemptyset(&none);
+		sigprocmask(SIG_SETMASK, &none, NULL);
+		execvp(argv[0], argv);
+		perror(argv[0]);
+		_exit(127);
+	}
+	free(argv);
+	return pid;
+}
+
+/* mainloop */
+int emulate(int baud, int stats_interval, int dump, const char **args, int nargs)
+{
+	static const int signals[] = { SIGTERM, SIGINT, SIGCHLD };
+	struct emulator *e = &emu;
+	unsigned int channel;
+
+	e->byte_ns = BITS_PER_BYTE * 1000000000ULL / baud;
+	e->state = calloc(CHANNELS, sizeof(unsigned short));
+	if (e->state == NULL) {
+		die("Unable to allocate channel table");
+	}
+
+	emu_open_pty(e);
+
+	reactor_init();
+	reactor_add_signals(&e->signal_h, signals, sizeof(signals) / sizeof(signals[0]),
+						emu_signal_event, e);
+	reactor_add(&e->h, e->master, EPOLLIN, emu_event, e);
+	reactor_add_oneshot(&e->timer_h, emu_timer_event, e);
+	if (stats_interval > 0) {
+		reactor_add_timer(&e->stats_h, stats_interval * 1000L, emu_stats_event, e);
+	}
+	e->last_report_ns = reactor_now();
+
+	msg_Info("Controller on %s at %i baud (%.1f frames/s)", e->path, baud,
+			 1e9 / (e->byte_ns * BUFFSIZE));
+	if (nargs > 0) {
+		e->child = emu_spawn(e, args, nargs, baud);
+	}
+
+	reactor_run();
+
+	if (e->child > 0) {
+		kill(e->child, SIGTERM);
+		waitpid(e->child, &e->status, 0);
+	}
+
+	emu_print_stats(e);
+	msg_Info("total: %lu frames, %lu malformed, %lu stray bytes",
+			 e->total_frames, e->total_malformed, e->total_garbage);
+
+	if (dump) {
+		/* after the messages, not in between */
+		msg_finish();
+		for (channel = 0; channel < CHANNELS; channel++) {
+			if (e->state[channel] != 0)
+				printf("%u %u\n", channel, e->state[channel]);
+		}
+	}
+
+	close(e->master);
+	close(e->slave);
+
+	if (nargs > 0 && WIFEXITED(e->status))
+		return WEXITSTATUS(e->status);
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	struct arg_int *baud = arg_int0("bB", "baud","","baud rate of the controller, default: 9600");
+	struct arg_int *statsint = arg_int0(NULL,"stats","","print statistics every n seconds");
+	struct arg_lit *dump = arg_lit0(NULL,"dump","print every channel with a value other than 0 at the end");
+	struct arg_str *server = arg_strn(NULL,NULL,"-- server [args]",0,100,"start the server with --serial set to the emulator");
+
+    struct arg_lit  *help    = arg_lit0("hH","help","print this help and exit");
+    struct arg_lit  *version = arg_lit0(NULL,"version","print version information and exit");
+
+	struct arg_lit  *debug = arg_lit0(NULL,"debug","print every frame");
+    struct arg_lit  *silent = arg_lit0(NULL,"silent","print no messages");
+
+    struct arg_end  *end     = arg_end(20);
+
+    void* argtable[] = {baud,statsint,dump,help,version,debug,silent,server,end};
+
+    int nerrors;
+    int exitcode=0;
+
+    /* verify the argtable[] entries were allocated sucessfully */
+    if (arg_nullcheck(argtable) != 0) {
+        printf("%s: insufficient memory\n",PROGNAME);
+        exitcode=1;
+        goto exit;
+	}
+
+    /* Parse the command line as defined by argtable[] */
+    nerrors = arg_parse(argc,argv,argtable);
+
+    /* special case: '--help' takes precedence over error reporting */
+    if (help->count > 0) {
+		printf("usage: %s", PROGNAME);
+        arg_print_syntax(stdout,argtable,"\n");
+        arg_print_glossary(stdout,argtable,"  %-25s %s\n");
+        exitcode=0;
+        goto exit;
+	}
+
+    /* special case: '--version' takes precedence error reporting */
+    if (version->count > 0) {
+        printf("'%s' version ",PROGNAME);
+		printf("%s",VERSION);
+		printf("\nGIT-REVISION: ");
+		printf("%s",GITREV);
+        printf("\n%s stands in for the EIWOMISA controller\n",PROGNAME);
+		printf("on a pseudo terminal\n");
+        printf("%s",COPYRIGHT);
+		printf("\n");
+        exitcode=0;
+        goto exit;
+	}
+
+    /* If the parser returned any errors then display them and exit */
+    if (nerrors > 0) {
+        arg_print_errors(stdout,end,PROGNAME);
+        printf("Try '%s --help' for more information.\n",PROGNAME);
+        exitcode=1;
+        goto exit;
+	}
+
+	/* check baud rate */
+	int i_baud = 9600;
+	if(baud->count>0) {
+		i_baud = (int)baud->ival[0];
+		if (i_baud <= 0) {
+			printf("%s: --baud must be positive\n", PROGNAME);
+			exitcode=1;
+			goto exit;
+		}
+	}
+
+	int i_stats = 0;
+	if(statsint->count>0) {
+		i_stats = (int)statsint->ival[0];
+	}
+
+	/* --debug prints every frame */
+    if (debug->count > 0) {
+		msglevel = 3;
+	}
+
+	/* --silent disables all (!) messages */
+    if (silent->count > 0) {
+		msglevel = 0;
+	}
+
+	/* the server's output goes through the same stdout */
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	/* from here on a thread prints the messages */
+	if (msglevel > 0) {
+		msg_start();
+	}
+
+	exitcode = emulate(i_baud, i_stats, dump->count > 0, server->sval, server->count);
+
+exit:
+    /* deallocate each non-null entry in argtable[] */
+    arg_freetable(argtable,sizeof(argtable)/sizeof(argtable[0]));
+
+    return exitcode;
+}
@@ -0,0 +1,79 @@
+/*****************************************************************************
+ * frame.h: frame validation
+ *****************************************************************************
+ * Copyright (C) 2009-2011 Kai Hermann
+ *
+ * Authors: Kai Hermann <kai.uwe.hermann at gmail dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/* The rules a frame has to pass before it goes anywhere near the
+ * controller, shared by the server, the emulator and the benchmarks. */
+
+/* check if buffer is valid */
+int checkbuffer (unsigned char *buffer) {
+	int error = 0;
+
+	/* byte0: startbyte = 255 */
+	if(buffer[0] == 255) {
+		msg_Dbg("buffer[0] == 255");
+	} else {
+		error = 1;
+		msg_Dbg("buffer[0] != 255");
+	}
+
+	/* byte1: value part 1/2*/
+	if(buffer[1] < 255) {
+		msg_Dbg("buffer[1] <255");
+	} else {
+		error = 1;
+		msg_Dbg("buffer[1] >= 255");
+	}
+
+	/* byte2: value part 2/2 */
+	if(buffer[2] < 2) {
+		msg_Dbg("buffer[2] <2");
+	} else {
+		error = 1;
+		msg_Dbg("buffer[2] >= 2");
+	}
+
+	/* byte3: channel part 1/3 */
+	if(buffer[3] < 255) {
+		msg_Dbg("buffer[3] <255");
+	} else {
+		error = 1;
+		msg_Dbg("buffer[3] >= 255");
+	}
+
+	/* byte4: channel part 2/3 */
+	if(buffer[4] < 255) {
+		msg_Dbg("buffer[4] <255");
+	} else {
+		error = 1;
+		msg_Dbg("buffer[4] >= 255");
+	}
+
+	/* byte5: channel part 3/3 */
+	if(buffer[5] < 5) {
+		msg_Dbg("buffer[5] <5");
+	} else {
+		error = 1;
+		msg_Dbg("buffer[5] >= 255");
+	}
+
+	return error;
+}
@@ -0,0 +1 @@
+#define GITREV "b5fe850bea235d17264d803aa2544b8721108fab"
@@ -0,0 +1,140 @@
+/*****************************************************************************
+ * latency.h: latency histograms
+ *****************************************************************************
+ * Copyright (C) 2011 Kai Hermann
+ *
+ * Authors: Kai Hermann <kai.uwe.hermann at gmail dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/* --latency follows frames from the kernel to the wire in three steps:
+ *   receive  kernel receive timestamp (SO_TIMESTAMPNS) -> checkbuffer() passed
+ *   queue    checkbuffer() passed -> the frame's write() is issued
+ *   drain    write() done -> the tty sent the frame, from TIOCOUTQ and the
+ *            byte time of the baud rate
+ * Each step has a log-linear histogram: 16 linear buckets per power of
+ * 2, so a percentile is off by at most 1/16. Any thread may record with
+ * a relaxed add; the reader keeps a copy of the previous counts and
+ * reports the difference, so each report covers one --stats interval
+ * without anyone resetting shared counters. */
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40	/* ~18 minutes in ns, longer is clamped */
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 2) * HIST_SUB)
+
+struct hist {
+	const char *name;
+	unsigned long count[HIST_BUCKETS];
+	unsigned long last[HIST_BUCKETS];	/* counts at the previous report */
+};
+
+enum { LAT_RECEIVE, LAT_QUEUE, LAT_DRAIN, LAT_STEPS };
+
+struct hist latency[LAT_STEPS] = {
+	{ .name = "receive" }, { .name = "queue" }, { .name = "drain" },
+};
+
+/* --latency, timestamps cost a clock read per frame */
+int latency_enabled = 0;
+
+unsigned int hist_index(uint64_t ns)
+{
+	unsigned int msb, shift;
+
+	if (ns < HIST_SUB)
+		return ns;
+	msb = 63 - __builtin_clzll(ns);
+	if (msb > HIST_MAX_BITS) {
+		msb = HIST_MAX_BITS;
+		ns = (2ULL << HIST_MAX_BITS) - 1;
+	}
+	shift = msb - HIST_SUB_BITS;
+	return (shift + 1) * HIST_SUB + (ns >> shift) - HIST_SUB;
+}
+
+/* upper end of a bucket */
+uint64_t hist_value(unsigned int i)
+{
+	unsigned int shift;
+
+	if (i < HIST_SUB)
+		return i;
+	shift = i / HIST_SUB - 1;
+	return ((uint64_t)(i % HIST_SUB + HIST_SUB + 1) << shift) - 1;
+}
+
+void hist_record(struct hist *h, uint64_t ns)
+{
+	__atomic_fetch_add(&h->count[hist_index(ns)], 1, __ATOMIC_RELAXED);
+}
+
+/* record the time from start to now, start 0 = not stamped */
+void latency_record(int step, uint64_t start, uint64_t now)
+{
+	if (start != 0 && now >= start)
+		hist_record(&latency[step], now - start);
+}
+
+/* p50, p99 and p99.9 of what was recorded since the last call */
+void hist_report(struct hist *h)
+{
+	static const double q[] = { 0.5, 0.99, 0.999 };
+	unsigned long delta[HIST_BUCKETS], total = 0, seen = 0;
+	double p[3] = { 0, 0, 0 };
+	unsigned int i, k = 0;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		unsigned long now = __atomic_load_n(&h->count[i], __ATOMIC_RELAXED);
+
+		delta[i] = now - h->last[i];
+		h->last[i] = now;
+		total += delta[i];
+	}
+	if (total == 0)
+		return;
+
+	for (i = 0; i < HIST_BUCKETS && k < 3; i++) {
+		seen += delta[i];
+		while (k < 3 && seen >= q[k] * total) {
+			p[k++] = hist_value(i) / 1e3;
+		}
+	}
+
+	msg_Info("stats: latency %s: p50 %.1f us, p99 %.1f us, p99.9 %.1f us (%lu frames)",
+			 h->name, p[0], p[1], p[2], total);
+}
+
+void latency_print_stats(void)
+{
+	int i;
+
+	if (!latency_enabled)
+		return;
+
+	for (i = 0; i < LAT_STEPS; i++) {
+		hist_report(&latency[i]);
+	}
+}
+
+/* CLOCK_REALTIME - CLOCK_MONOTONIC, receive timestamps are wall clock */
+int64_t latency_clock_offset(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec - (int64_t)reactor_now();
+}
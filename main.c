@@ -20,23 +20,33 @@
  * Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
  *****************************************************************************/
 
+#define _GNU_SOURCE /* recvmmsg() */
+
 #include "git_rev.h"
 
 #define VERSION "0.4"
 #define PROGNAME "eiwomisarc_server"
 #define COPYRIGHT "2009-2011, Kai Hermann"
 #define BUFFSIZE 6
+#define MAXDATAGRAM 1472 /* UDP payload of a 1500 byte MTU, 245 frames */
+#define MAXBATCH 1024
+#define RX_CONTROLLEN 64 /* room for the SO_TIMESTAMPNS cmsg */
 
 /* UDP & other includes */
 #include <stdio.h>
+#include <stdint.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <netinet/in.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 
 /* RS-232 */
+#include <limits.h>
+#include <sys/ioctl.h> /* TIOCOUTQ */
 #include <fcntl.h>   /* file control definitions */
 #include <errno.h>   /* error number definitions */
 #include <termios.h> /* POSIX terminal control definitions */
@@ -44,193 +54,396 @@
 /* message functions */
 #include "messages.h"
 
+/* runtime counters */
+#include "stats.h"
+
 /* argtable */
 #include "argtable2/argtable2.h"
 
 /* signal handling */
 #include <signal.h>
 
-/* global serial port */
-int global_serialport = -1;
+/* event loop */
+#include "reactor.h"
+
+/* latency histograms */
+#include "latency.h"
+
+/* allowed clients */
+#include "allowlist.h"
+
+/* per client rate limit */
+#include "ratelimit.h"
+
+/* BPF pre-filter on the socket */
+#include "sockfilter.h"
+
+/* latest value per channel */
+#include "coalesce.h"
+
+/* shared channel table for receive workers */
+#include "chantable.h"
+
+/* lock-free hand-off to writer threads */
+#include "spsc.h"
+
+/* fair share per client */
+#include "drr.h"
+
+/* RS-232 port handling */
+#include "serial.h"
+
+/* io_uring engine */
+#include "uring.h"
+
+/* AF_XDP engine */
+#include "xdp.h"
+
+/* shared memory ring for local producers */
+#include "shmingest.h"
+
+/* streaming clients */
+#include "tcpingest.h"
+
+/* binding unix sockets */
+#include "unixsock.h"
+
+/* Prometheus endpoint */
+#include "metrics.h"
+
+/* checkbuffer() */
+#include "frame.h"
+
+/* check a received datagram and forward its frames to the serial port,
+ * a datagram carries any number of back-to-back frames; rxstamp is when
+ * the kernel got it (reactor_now() clock), 0 if unknown */
+void handle_datagram(unsigned char *buffer, int received,
+					 struct sockaddr_in *client, struct allowlist *allow, uint64_t rxstamp)
+{
+	struct rl_client *bucket = NULL;
+	uint64_t now = 0, stamp = 0;
+	int offset;
+
+	rxstats_inc(datagrams);
 
-/* signal handler */
-void sigfunc(int sig) {
-	if(global_serialport != -1) {
-		close(global_serialport);
+	if(allow != NULL && !allow_check(allow, client->sin_addr.s_addr)) {
+		rxstats_inc(rejected_client);
+		msg_Info("Wrong client tried to connect to server: %s", inet_ntoa(client->sin_addr));
+		return;
+	}
+
+	msg_Info("Client connected: %s", inet_ntoa(client->sin_addr));
+
+	if (ratelimit.clients != NULL) {
+		bucket = ratelimit_find(&ratelimit, client->sin_addr.s_addr);
+		now = reactor_now();
+	}
+
+	/* the receivers ask for the real length (MSG_TRUNC), everything
+	 * past the buffer is lost; count it instead of parsing a cut frame */
+	if (received > MAXDATAGRAM) {
+		int kept = MAXDATAGRAM - MAXDATAGRAM % BUFFSIZE;
+
+		rxstats_add(rejected_frame, (received - kept + BUFFSIZE - 1) / BUFFSIZE);
+		msg_Dbg("datagram of %i bytes truncated to %i", received, kept);
+		received = kept;
+	}
+
+	if (received % BUFFSIZE != 0) {
+		rxstats_inc(rejected_frame);
+		msg_Dbg("ignoring %i trailing bytes", received % BUFFSIZE);
+	}
+
+	for (offset = 0; offset + BUFFSIZE <= received; offset += BUFFSIZE) {
+		unsigned char *frame = buffer + offset;
+		struct serialport *sp;
+
+		rxstats_inc(frames);
+
+		if (checkbuffer(frame) != 0) {
+			rxstats_inc(rejected_frame);
+			continue;
+		}
+
+		if (latency_enabled) {
+			stamp = reactor_now();
+			latency_record(LAT_RECEIVE, rxstamp, stamp);
+		}
+
+		if (bucket != NULL && !ratelimit_take(&ratelimit, bucket, now)) {
+			rxstats_inc(rate_limited);
+			msg_Dbg("%s over its rate, frame dropped", inet_ntoa(client->sin_addr));
+			continue;
+		}
+
+		msg_Dbg("buffer0-5: '%.6s'", frame);
+
+		sp = serial_route(frame_channel(frame));
+		if (sp == NULL) {
+			rxstats_inc(unrouted);
+			msg_Dbg("no serial port for channel %u", frame_channel(frame));
+			continue;
+		}
+		serial_post(sp, frame, client->sin_addr.s_addr, stamp);
 	}
-	printf("\n");
-	exit (0);
 }
 
-/* check for valid baudrate
- * throw _warning_ if baudrate is exotic */
-int check_baudrate(int pBaud)
+/* UDP receiver state, the batch arrays are allocated once at startup */
+struct receiver {
+	int sock;
+	struct allowlist *allow;
+	int batch;
+	int local;	/* AF_UNIX socket, no address to check */
+	struct mmsghdr *msgs;
+	struct iovec *iovecs;
+	struct sockaddr_in *clients;
+	unsigned char (*buffers)[MAXDATAGRAM];
+	unsigned char (*controls)[RX_CONTROLLEN];	/* SO_TIMESTAMPNS, --latency */
+	struct handler h;
+};
+
+struct receiver receiver;
+
+/* --unix, local producers on the same box */
+struct receiver local_receiver;
+
+/* what local producers look like to the rate limit and --fair,
+ * 127.0.0.1 once mymain() filled it in */
+struct sockaddr_in local_client;
+
+/* kernel receive time of a message on the reactor_now() clock, 0 if none */
+uint64_t receiver_stamp(struct msghdr *m, int64_t offset)
 {
-	switch (pBaud) {
-		case B0: break;
-		case B50: break;
-		case B75: break;
-		case B110: break;
-		case B134: break;
-		case B150: break;
-		case B200: break;
-		case B300: break;
-		case B600: break;
-		case B1200: break;
-		case B1800: break;
-		case B2400: break;
-		case B4800: break;
-		case B9600: break;
-		case B19200: break;
-		case B38400: break;
-		default:
-			msg_Dbg("BAUDRATE seems to be a little bit exotic\nbut hey, you'll know what you are doing ;)");
-			break;
+	struct cmsghdr *c;
+	struct timespec ts;
+
+	for (c = CMSG_FIRSTHDR(m); c != NULL; c = CMSG_NXTHDR(m, c)) {
+		if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPNS) {
+			memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+			return (uint64_t)((int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec - offset);
+		}
 	}
 	return 0;
 }
 
-/* open serial port
- * returns the file descriptor on success or -1 on error */
-int open_port(const char *pPort, int pBaud)
+/* preallocate the recvmmsg() arrays */
+void receiver_init_batch(struct receiver *r)
 {
-	/* serial port file descriptor */
-	int fd = open(pPort, O_RDWR | O_NOCTTY | O_NDELAY);
-	
-	if(fd == -1) {
-		msg_Err("Unable to open serial-port");
-		msg_Info("Retrying in 5 seconds...");
-		sleep(5);
-		fd = open(pPort, O_RDWR | O_NOCTTY | O_NDELAY);
-	}
-	
-	if (fd == -1) {
-		die("Unable to open serial-port");
-	} else {
-		fcntl(fd, F_SETFL, 0);
-		
-		struct termios options;
-		
-		/* get the current options for the port */
-		tcgetattr(fd, &options);
-		
-		check_baudrate(pBaud);
-		
-		/* set baudrate */
-		cfsetispeed(&options, pBaud);
-		cfsetospeed(&options, pBaud);
-		
-		/* enable the receiver and set local mode */
-		options.c_cflag |= (CLOCAL | CREAD);
-		
-		/* set the new options for the port */
-		tcsetattr(fd, TCSANOW, &options);
-		
-		msg_Dbg("BAUDRATE SET TO %i",pBaud);
-	}
-	return (fd);
-}
+	int i;
 
-/* check if buffer is valid */
-int checkbuffer (unsigned char *buffer) {
-	int error = 0;
+	r->msgs = calloc(r->batch, sizeof(struct mmsghdr));
+	r->iovecs = calloc(r->batch, sizeof(struct iovec));
+	r->clients = calloc(r->batch, sizeof(struct sockaddr_in));
+	r->buffers = calloc(r->batch, MAXDATAGRAM);
+	r->controls = calloc(r->batch, RX_CONTROLLEN);
 
-	/* byte0: startbyte = 255 */
-	if(buffer[0] == 255) {
-		msg_Dbg("buffer[0] == 255");
-	} else {
-		error = 1;
-		msg_Dbg("buffer[0] != 255");
+	if (r->msgs == NULL || r->iovecs == NULL || r->clients == NULL || r->buffers == NULL
+		|| r->controls == NULL) {
+		die("Unable to allocate receive batch");
 	}
 
-	/* byte1: value part 1/2*/
-	if(buffer[1] < 255) {
-		msg_Dbg("buffer[1] <255");
-	} else {
-		error = 1;
-		msg_Dbg("buffer[1] >= 255");
+	for (i = 0; i < r->batch; i++) {
+		r->iovecs[i].iov_base = r->buffers[i];
+		r->iovecs[i].iov_len = MAXDATAGRAM;
+		r->msgs[i].msg_hdr.msg_iov = &r->iovecs[i];
+		r->msgs[i].msg_hdr.msg_iovlen = 1;
+		r->msgs[i].msg_hdr.msg_name = r->local ? NULL : &r->clients[i];
+		if (latency_enabled)
+			r->msgs[i].msg_hdr.msg_control = r->controls[i];
 	}
 
-	/* byte2: value part 2/2 */
-	if(buffer[2] < 2) {
-		msg_Dbg("buffer[2] <2");
+	msg_Dbg("Receiving up to %i datagrams per call", r->batch);
+}
+
+/* receive one batch (or a single datagram)
+ * returns the number of datagrams handled, 0 if the socket is drained */
+int receiver_poll(struct receiver *r)
+{
+	int64_t offset = latency_enabled ? latency_clock_offset() : 0;
+	int received, i;
+
+	if (r->batch > 1) {
+		/* namelen and controllen are value-result fields, reset them
+		 * for every call */
+		for (i = 0; i < r->batch; i++) {
+			r->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+			if (latency_enabled)
+				r->msgs[i].msg_hdr.msg_controllen = RX_CONTROLLEN;
+		}
+
+		received = recvmmsg(r->sock, r->msgs, r->batch, MSG_DONTWAIT | MSG_TRUNC, NULL);
+		if (received > 0) {
+			rxstats_inc(recv_calls);
+			for (i = 0; i < received; i++) {
+				handle_datagram(r->buffers[i], r->msgs[i].msg_len,
+								r->local ? &local_client : &r->clients[i], r->allow,
+								latency_enabled ? receiver_stamp(&r->msgs[i].msg_hdr, offset) : 0);
+			}
+		}
 	} else {
-		error = 1;
-		msg_Dbg("buffer[2] >= 2");
+		unsigned char buffer[MAXDATAGRAM];
+		unsigned char control[RX_CONTROLLEN];
+		struct sockaddr_in client;
+		struct iovec iov = { .iov_base = buffer, .iov_len = MAXDATAGRAM };
+		struct msghdr msg = {
+			.msg_name = r->local ? NULL : &client,
+			.msg_namelen = r->local ? 0 : sizeof(client),
+			.msg_iov = &iov,
+			.msg_iovlen = 1,
+			.msg_control = latency_enabled ? control : NULL,
+			.msg_controllen = latency_enabled ? sizeof(control) : 0,
+		};
+
+		received = recvmsg(r->sock, &msg, MSG_DONTWAIT | MSG_TRUNC);
+		if (received >= 0) {
+			rxstats_inc(recv_calls);
+			handle_datagram(buffer, received, r->local ? &local_client : &client, r->allow,
+							latency_enabled ? receiver_stamp(&msg, offset) : 0);
+			received = 1;
+		}
 	}
 
-	/* byte3: channel part 1/3 */
-	if(buffer[3] < 255) {
-		msg_Dbg("buffer[3] <255");
-	} else {
-		error = 1;
-		msg_Dbg("buffer[3] >= 255");
+	if (received < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return 0;
+		die("Failed to receive message\n");
 	}
+	return received;
+}
 
-	/* byte4: channel part 2/3 */
-	if(buffer[4] < 255) {
-		msg_Dbg("buffer[4] <255");
-	} else {
-		error = 1;
-		msg_Dbg("buffer[4] >= 255");
+/* socket is readable: drain it, but give the other fds a turn now and then */
+void receiver_event(struct handler *h, unsigned int events)
+{
+	struct receiver *r = h->arg;
+	int rounds;
+
+	for (rounds = 0; rounds < 64; rounds++) {
+		if (receiver_poll(r) == 0)
+			break;
 	}
+}
 
-	/* byte5: channel part 3/3 */
-	if(buffer[5] < 5) {
-		msg_Dbg("buffer[5] <5");
-	} else {
-		error = 1;
-		msg_Dbg("buffer[5] >= 255");
+/* classic engine: recvfrom()/recvmmsg() on EPOLLIN */
+void receiver_start(void)
+{
+	if (receiver.batch > 1 && receiver.msgs == NULL) {
+		receiver_init_batch(&receiver);
 	}
+	reactor_add(&receiver.h, receiver.sock, EPOLLIN, receiver_event, &receiver);
+}
+
+/* SO_REUSEPORT receive workers, each with its own socket and loop */
+#define MAXWORKERS 64
+
+struct worker {
+	struct receiver r;
+	struct stats stats;	/* receive counters, see rxstats */
+	struct ratelimit rl;	/* limits to copy, the table is per thread */
+	int cpu;
+	int stop_fd;
+	pthread_t thread;
+	struct handler stop_h;
+};
+
+struct worker workers[MAXWORKERS];
+int nworkers = 0;
 
-	return error;
+void worker_stop_event(struct handler *h, unsigned int events)
+{
+	reactor_running = 0;
 }
 
-/*	check if IP address is provided in a valid format,
- if ip is invalid, use localhost. */
-in_addr_t check_ip(char *pIp)
+void *worker_thread(void *arg)
 {
-	in_addr_t ip;
-	if(inet_pton(AF_INET, pIp, &ip) < 1) {
-	msg_Err("Incorrect client IP provided, using 127.0.0.1");
-		inet_pton(AF_INET, "127.0.0.1", &ip);
-	}
-	return ip;
+	struct worker *w = arg;
+
+	rxstats = &w->stats;
+	if (w->rl.clients != NULL)
+		ratelimit_clone(&ratelimit, &w->rl);
+
+	reactor_init();
+	if (w->r.batch > 1)
+		receiver_init_batch(&w->r);
+	reactor_add(&w->r.h, w->r.sock, EPOLLIN, receiver_event, &w->r);
+	reactor_add(&w->stop_h, w->stop_fd, EPOLLIN, worker_stop_event, w);
+	reactor_run();
+
+	close(reactor_fd);
+	return NULL;
 }
 
-/* mainloop */
-int mymain(int port, char *serialport, int baud, char *validip)
+/* start a worker on sock, cpu < 0 = don't pin it */
+void worker_start(struct worker *w, int sock, struct allowlist *allow, int batch, int cpu)
 {
-	/* check if port, serialport and baudrate are set, otherwise use defaults */
-	if (port == -1) {
-		msg_Info("No Port set - using 1337");
-		port = 1337;
+	cpu_set_t set;
+
+	w->r.sock = sock;
+	w->r.allow = allow;
+	w->r.batch = batch;
+	w->rl = ratelimit;
+	w->cpu = cpu;
+	stats_register(&w->stats);
+	w->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (w->stop_fd < 0) {
+		die("Failed to create eventfd");
 	}
 
-	if (serialport == NULL) {
-		msg_Info("No Serialport set - using /dev/ttyS0");
-		serialport = "/dev/ttyS0";
+	if (pthread_create(&w->thread, NULL, worker_thread, w) != 0) {
+		die("Unable to start receive worker");
 	}
 
-	if (baud == -1) {
-		msg_Info("No Baudrate set - using 9600");
-		baud = 9600;
+	if (cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (pthread_setaffinity_np(w->thread, sizeof(set), &set) != 0) {
+			msg_Err("Unable to pin receive worker to CPU %i", cpu);
+		}
 	}
+}
 
-	int sock;
-	struct sockaddr_in server;
-	struct sockaddr_in client;
+void worker_stop(struct worker *w)
+{
+	uint64_t one = 1;
 
-	unsigned char buffer[BUFFSIZE];
+	if (write(w->stop_fd, &one, sizeof(one)) < 0)
+		msg_Dbg("Unable to stop receive worker");
+	pthread_join(w->thread, NULL);
+	close(w->stop_fd);
+	close(w->r.sock);
+}
+
+/* datagrams per worker, shows how SO_REUSEPORT spreads the clients */
+void worker_print_stats(void)
+{
+	int i;
 
-	unsigned int clientlen, serverlen;
-	int received = 0;
+	for (i = 0; i < nworkers; i++) {
+		msg_Info("stats: worker %i%s: %lu datagrams", i,
+				 workers[i].cpu >= 0 ? " (pinned)" : "",
+				 __atomic_load_n(&workers[i].stats.datagrams, __ATOMIC_RELAXED));
+	}
+}
+
+/* UDP socket on port, with reuseport several of them share the port */
+int udp_socket(int port, int reuseport)
+{
+	struct sockaddr_in server;
+	int sock, on = 1;
 
 	/* create the UDP socket */
-	if ((sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+	if ((sock = socket(PF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP)) < 0) {
 		die("Failed to create socket\n");
 	}
 
+	if (reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+		die("Failed to set SO_REUSEPORT\n");
+	}
+
+	/* the kernel's receive time for --latency */
+	if (latency_enabled && setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0) {
+		msg_Err("Unable to enable receive timestamps");
+	}
+
 	/* construct the server sockaddr_in structure */
 	memset(&server, 0, sizeof(server));			/* Clear struct */
 	server.sin_family = AF_INET;				/* Internet/IP */
@@ -238,63 +451,354 @@ int mymain(int port, char *serialport, int baud, char *validip)
 	server.sin_port = htons(port);				/* server port */
 
 	/* bind the socket */
-	serverlen = sizeof(server);
-	if (bind(sock, (struct sockaddr *) &server, serverlen) < 0) {
+	if (bind(sock, (struct sockaddr *) &server, sizeof(server)) < 0) {
 		die("Failed to bind server socket\n");
 	}
-	
+	return sock;
+}
+
+/* AF_UNIX datagram socket at path, the file mode decides who may send */
+int unix_socket(const char *path, int mode)
+{
+	int sock, on = 1;
+
+	if ((sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+		die("Failed to create unix socket\n");
+	}
+
+	if (unix_bind(sock, path, mode) < 0) {
+		die("Failed to bind unix socket\n");
+	}
+	if (latency_enabled && setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0) {
+		msg_Err("Unable to enable receive timestamps");
+	}
+	return sock;
+}
+
+/* SIGTERM/SIGINT stop the loop, SIGHUP prints the counters */
+void signal_event(struct handler *h, unsigned int events)
+{
+	struct signalfd_siginfo si;
+
+	while (read(h->fd, &si, sizeof(si)) == sizeof(si)) {
+		if (si.ssi_signo == SIGHUP) {
+			stats_print();
+		} else {
+			reactor_running = 0;
+		}
+	}
+}
+
+void stats_event(struct handler *h, unsigned int events)
+{
+	if (reactor_timer_ack(h) > 0)
+		stats_print();
+}
+
+/* the command line, main() fills it in once it checked the options */
+struct options {
+	int port;			/* -1: default */
+	int baud;			/* -1: default, ports may have their own */
+	struct allowlist *allow;	/* NULL: any client */
+	int batch;
+	char *engine;			/* NULL: classic */
+	char *xdp_if;
+	int xdp_queue;
+	int coalesce;
+	int queuelen;
+	int highwater;
+	int drop_policy;
+	int pace;
+	int threaded;			/* writer threads, pinned to cpus */
+	int *cpus;
+	int ncpus;
+	int suppress;
+	int refresh;
+	int fair;
+	int kernelfilter;
+	int nwork;			/* receive workers, pinned to wcpus */
+	int *wcpus;
+	int nwcpus;
+	char *unixpath;
+	int unixmode;
+	char *shmname;
+	int shmsize;
+	int shmpoll;
+	int tcpport;
+	int tcpmax;
+	char *metricsaddr;
+};
+
+/* mainloop */
+int mymain(struct options *opt)
+{
+	int i;
+
+	/* check if port, serialport and baudrate are set, otherwise use defaults */
+	if (opt->port == -1) {
+		msg_Info("No Port set - using 1337");
+		opt->port = 1337;
+	}
+
+	if (nports == 0) {
+		msg_Info("No Serialport set - using /dev/ttyS0");
+		serial_add_spec("/dev/ttyS0");
+	}
+
+	if (opt->baud == -1) {
+		msg_Info("No Baudrate set - using 9600");
+		opt->baud = 9600;
+	}
+
+	int sock = -1;
+
+	static const int signals[] = { SIGTERM, SIGINT, SIGHUP };
+	struct handler signal_h, stats_h;
+
+	/* receive workers bind their own sockets further down */
+	if (opt->nwork == 0) {
+		sock = udp_socket(opt->port, 0);
+
+		/* the kernel drops what we would reject anyway */
+		if (opt->kernelfilter) {
+			sockfilter_attach(sock, opt->allow);
+		}
+	}
+
+	reactor_init();
+
 	/* signal handler */
-	signal(SIGTERM,sigfunc);
-	signal(SIGINT,sigfunc);
+	reactor_add_signals(&signal_h, signals, sizeof(signals) / sizeof(signals[0]),
+						signal_event, NULL);
 
-	/* open serial port */
-	global_serialport = open_port(serialport, baud);
-	
-	/* wait for UDP-packets */
-	while (42) {
-		/* Receive a message from the client */
-		clientlen = sizeof(client);
-
-		if ((received = recvfrom(sock, buffer, BUFFSIZE, 0,
-								 (struct sockaddr *) &client,
-								 &clientlen)) < 0) {
-			die("Failed to receive message\n");
-		}
-		
-		if(validip != NULL && client.sin_addr.s_addr != check_ip(validip)) {
-			msg_Info("Wrong client tried to connect to server: %s", inet_ntoa(client.sin_addr));
+	/* open serial ports, each one with its own queue and pacing */
+	for (i = 0; i < nports; i++) {
+		struct serialport *sp = &ports[i];
+
+		serial_init_queue(sp, opt->queuelen, opt->highwater, opt->drop_policy);
+		serial_open(sp, sp->baud > 0 ? sp->baud : opt->baud, opt->pace);
+
+		if (opt->nwork > 0) {
+			static struct chantable ct[MAXPORTS];
+
+			/* the workers store into the table, this thread drains it */
+			chantable_init(&ct[i], sp->lo, sp->hi - sp->lo + 1);
+			sp->ct = &ct[i];
+			if (latency_enabled)
+				chantable_track(sp->ct);
+			msg_Dbg("Coalescing frames from %i workers on %s", opt->nwork, sp->path);
+		} else if (opt->coalesce) {
+			static struct coalescer co[MAXPORTS];
+
+			coalesce_init(&co[i], sp->lo, sp->hi - sp->lo + 1);
+			sp->co = &co[i];
+			if (latency_enabled)
+				coalesce_track(sp->co);
+			msg_Dbg("Coalescing frames per channel on %s", sp->path);
+		}
+
+		if (opt->fair) {
+			static struct drr drr[MAXPORTS];
+
+			/* the port's queue only ever holds a burst, the
+			 * limits apply to each client instead */
+			drr_init(&drr[i], opt->queuelen, opt->highwater, opt->drop_policy == DROP_OLDEST);
+			sp->drr = &drr[i];
+			msg_Dbg("Sharing %s fairly between clients", sp->path);
+		}
+
+		if (opt->suppress) {
+			serial_init_shadow(sp, opt->refresh);
+		}
+
+		if (sp->ranged) {
+			msg_Info("%s takes channels %u-%u", sp->path, sp->lo, sp->hi);
+		}
+
+		/* the thread attaches the port to its own loop */
+		if (opt->threaded) {
+			serial_start_thread(sp, opt->queuelen, i < opt->ncpus ? opt->cpus[i] : -1);
 		} else {
-			msg_Info("Client connected: %s", inet_ntoa(client.sin_addr));
-			
-			if (checkbuffer(buffer) == 0) {
-				msg_Dbg("buffer0-5: '%s'", buffer);
-				
-				/* RS-232 Code start */
-				int n = write(global_serialport, buffer, BUFFSIZE);
-				
-				if (n < 0) {
-					msg_Err("write() failed!");
-				} else {
-					msg_Dbg("Value(s) written to serial port");
-				}
-				/* RS-232 Code end */
+			serial_attach(sp);
+		}
+	}
+
+	/* wait for UDP-packets */
+	receiver.sock = sock;
+	receiver.allow = opt->allow;
+	receiver.batch = opt->batch;
+	if (opt->nwork > 0) {
+		/* the kernel hashes each client to one of the sockets */
+		for (i = 0; i < opt->nwork; i++) {
+			int wsock = udp_socket(opt->port, 1);
+
+			if (opt->kernelfilter) {
+				sockfilter_attach(wsock, opt->allow);
 			}
+			worker_start(&workers[i], wsock, opt->allow, opt->batch, i < opt->nwcpus ? opt->wcpus[i] : -1);
+			nworkers++;
+		}
+		msg_Info("Receiving with %i workers", opt->nwork);
+	} else if (opt->engine != NULL && strncmp(opt->engine, "uring", 5) == 0) {
+		/* writer threads do their own writes, the ring only receives */
+		if (uring_start(&uring, sock, opt->allow, ports, opt->threaded ? 0 : nports,
+						strcmp(opt->engine, "uring-sqpoll") == 0, receiver_start) < 0) {
+			msg_Err("falling back to the classic engine");
+			receiver_start();
+		}
+	} else if (opt->engine != NULL && strcmp(opt->engine, "xdp") == 0) {
+		/* the socket still gets what the XDP program passes on */
+		if (xdp_start(&xdp, opt->xdp_if, opt->xdp_queue, opt->port, opt->allow) < 0) {
+			msg_Err("falling back to the classic engine");
 		}
+		receiver_start();
+	} else {
+		receiver_start();
 	}
-	
-	/* close serial port */
-	close(global_serialport);
-    return 0;
+
+	/* local producers skip the IP stack and the client check */
+	if (opt->unixpath != NULL) {
+		local_receiver.sock = unix_socket(opt->unixpath, opt->unixmode);
+		local_receiver.allow = NULL;
+		local_receiver.batch = opt->batch;
+		local_receiver.local = 1;
+		local_client.sin_family = AF_INET;
+		local_client.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if (opt->batch > 1)
+			receiver_init_batch(&local_receiver);
+		reactor_add(&local_receiver.h, local_receiver.sock, EPOLLIN,
+					receiver_event, &local_receiver);
+		msg_Info("Listening on %s", opt->unixpath);
+	}
+
+	if (opt->shmname != NULL) {
+		shmingest_start(&shmingest, opt->shmname, opt->shmsize, opt->shmpoll);
+	}
+
+	if (opt->tcpport > 0) {
+		tcp_start(&tcpingest, opt->tcpport, opt->tcpmax, opt->allow);
+	}
+
+	if (opt->metricsaddr != NULL) {
+		metrics_start(&metrics, opt->metricsaddr);
+	}
+
+	if (stats_interval > 0) {
+		reactor_add_timer(&stats_h, stats_interval * 1000L, stats_event, NULL);
+	}
+
+	reactor_run();
+
+	xdp_stop(&xdp);
+	for (i = 0; i < nworkers; i++) {
+		worker_stop(&workers[i]);
+	}
+	for (i = 0; i < nports; i++) {
+		serial_stop_thread(&ports[i]);
+	}
+
+	printf("\n");
+	if (stats_interval > 0) {
+		stats_print();
+	}
+
+	/* close serial ports */
+	for (i = 0; i < nports; i++) {
+		close(ports[i].fd);
+	}
+	if (sock >= 0)
+		close(sock);
+	if (opt->unixpath != NULL) {
+		close(local_receiver.sock);
+		unlink(opt->unixpath);
+	}
+	shmingest_stop(&shmingest);
+	tcp_stop(&tcpingest);
+	metrics_stop(&metrics);
+	return 0;
+}
+
+/* one serial port spec per line, '#' starts a comment
+ * returns 0 on success, -1 after printing what is wrong */
+int read_serial_config(const char *file)
+{
+	char line[256];
+	const char *error;
+	int lineno = 0;
+	FILE *f = fopen(file, "r");
+
+	if (f == NULL) {
+		printf("%s: unable to open %s\n", PROGNAME, file);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		char *spec = line, *end;
+
+		lineno++;
+		if ((end = strchr(spec, '#')) != NULL)
+			*end = '\0';
+		while (*spec == ' ' || *spec == '\t')
+			spec++;
+		end = spec + strlen(spec);
+		while (end > spec && (end[-1] == '\n' || end[-1] == '\r'
+							  || end[-1] == ' ' || end[-1] == '\t'))
+			*--end = '\0';
+		if (*spec == '\0')
+			continue;
+
+		if ((error = serial_add_spec(spec)) != NULL) {
+			printf("%s: %s:%i: %s\n", PROGNAME, file, lineno, error);
+			fclose(f);
+			return -1;
+		}
+	}
+
+	fclose(f);
+	return 0;
 }
 
 int main(int argc, char **argv)
 {
 	struct arg_int *serverport = arg_int0("pP","port","","serverport, default: 1337");
-	struct arg_str *serialport = arg_str0("sS", "serial", "", "serial port, default /dev/ttyS0");
+	struct arg_str *serialport = arg_strn("sS", "serial", "", 0, MAXPORTS,
+										  "serial port as device[:baud[:first-last channel]], repeatable, default /dev/ttyS0");
+	struct arg_file *serialconf = arg_file0(NULL, "serial-config", "", "read serial ports from a file, one per line");
 
-	struct arg_int *baud = arg_int0("bB", "baud","","baudrate, default: 9600");
+	struct arg_int *baud = arg_int0("bB", "baud","","baudrate, any rate the adapter can do, default: 9600");
 	
-	struct arg_str *client = arg_str0("cC","client","","only accept messages from this client");
+	struct arg_str *client = arg_strn("cC","client","",0,1000,"only accept messages from this client or a.b.c.d/n network, repeatable or comma separated");
+
+	struct arg_int *batch = arg_int0(NULL,"batch","","receive up to n datagrams per syscall, default: 1");
+	struct arg_int *statsint = arg_int0(NULL,"stats","","print statistics every n seconds");
+	struct arg_str *engine = arg_str0(NULL,"engine","","classic, uring, uring-sqpoll or xdp, default: classic");
+	struct arg_str *xdpif = arg_str0(NULL,"xdp-if","","with --engine xdp, interface to take packets from");
+	struct arg_int *xdpqueue = arg_int0(NULL,"xdp-queue","","with --engine xdp, receive queue of the interface, default: 0");
+	struct arg_lit *coalesce = arg_lit0(NULL,"coalesce","only send the latest value of each channel");
+	struct arg_int *queuelen = arg_int0(NULL,"queue","","serial output queue in frames, default: 1024, with --fair per client, default: 64");
+	struct arg_int *highwater = arg_int0(NULL,"highwater","","drop frames above this queue length, default: queue size, with --fair per client");
+	struct arg_str *drop = arg_str0(NULL,"drop","","newest or oldest, which frame to drop, default: newest");
+	struct arg_int *pace = arg_int0(NULL,"pace","","pace output at n% of the baud rate's capacity, e.g. 95");
+	struct arg_lit *suppress = arg_lit0(NULL,"suppress","don't send values the controller already has");
+	struct arg_int *refresh = arg_int0(NULL,"refresh","","with --suppress, send every value again after n seconds");
+	struct arg_int *rate = arg_int0(NULL,"rate","","accept up to n frames/s from each client");
+	struct arg_int *burst = arg_int0(NULL,"burst","","with --rate, frames a client may send at once, default: one second's worth");
+	struct arg_lit *fair = arg_lit0(NULL,"fair","share the link fairly between clients instead of first come first served");
+	struct arg_str *weight = arg_strn(NULL,"weight","",0,DRR_MAXWEIGHTS,"client=n, with --fair give this client n shares, default: 1, implies --fair");
+	struct arg_lit *kernelfilter = arg_lit0(NULL,"kernel-filter","drop datagrams from wrong clients or with broken frames in the kernel");
+	struct arg_lit *writerthread = arg_lit0(NULL,"writer-thread","write each serial port from its own thread");
+	struct arg_int *writercpu = arg_intn(NULL,"writer-cpu","",0,MAXPORTS,"pin the next port's writer thread to this CPU, implies --writer-thread");
+	struct arg_int *nworkers = arg_int0(NULL,"workers","","receive with n threads sharing the port (SO_REUSEPORT), implies --coalesce");
+	struct arg_int *workercpu = arg_intn(NULL,"worker-cpu","",0,MAXWORKERS,"pin the next receive worker to this CPU");
+	struct arg_str *unixsock = arg_str0(NULL,"unix","","also receive frames on this unix datagram socket");
+	struct arg_str *unixmode = arg_str0(NULL,"unix-mode","","with --unix, octal permissions of the socket, default: 0660");
+	struct arg_str *shm = arg_str0(NULL,"shm","","also take frames from this POSIX shared memory ring, e.g. /eiwomisa");
+	struct arg_int *shmsize = arg_int0(NULL,"shm-size","","with --shm, ring size in frames, default: 65536");
+	struct arg_int *tcpport = arg_int0(NULL,"tcp","","also accept frame streams on this TCP port");
+	struct arg_int *tcpmax = arg_int0(NULL,"tcp-max","","with --tcp, connections at once, default: 16");
+	struct arg_str *metricsaddr = arg_str0(NULL,"metrics","","serve Prometheus metrics on this port of 127.0.0.1 or unix socket path");
+	struct arg_lit *latencyopt = arg_lit0(NULL,"latency","with --stats, report receive, queue and drain latency percentiles");
+	struct arg_int *shmpoll = arg_int0(NULL,"shm-poll","","with --shm, also look at the ring every n ms, default: 0 = never");
 
     struct arg_lit  *help    = arg_lit0("hH","help","print this help and exit");
     struct arg_lit  *version = arg_lit0(NULL,"version","print version information and exit");
@@ -304,7 +808,7 @@ int main(int argc, char **argv)
 
     struct arg_end  *end     = arg_end(20);
 
-    void* argtable[] = {serverport,serialport,baud,client,help,version,debug,silent,end};
+    void* argtable[] = {serverport,serialport,serialconf,baud,client,batch,statsint,engine,xdpif,xdpqueue,coalesce,queuelen,highwater,drop,pace,suppress,refresh,rate,burst,fair,weight,kernelfilter,writerthread,writercpu,nworkers,workercpu,unixsock,unixmode,shm,shmsize,shmpoll,tcpport,tcpmax,metricsaddr,latencyopt,help,version,debug,silent,end};
 
     int nerrors;
     int exitcode=0;
@@ -362,31 +866,354 @@ int main(int argc, char **argv)
 	}
 
     /* normal case: take the command line options at face value */
+	struct options opt = {
+		.port = -1, .baud = -1, .batch = 1, .queuelen = SERIAL_QUEUELEN,
+		.drop_policy = DROP_NEWEST, .unixmode = 0660, .shmsize = 65536, .tcpmax = 16,
+	};
 
 	/* check if server port is set */
-	int i_serverport = -1;
 	if(serverport->count>0)
-		i_serverport = (int)serverport->ival[0];
+		opt.port = (int)serverport->ival[0];
+
+	/* check which serial ports to use */
+	int i;
+	for (i = 0; i < serialport->count; i++) {
+		const char *error = serial_add_spec(serialport->sval[i]);
 
-	/* check if serial port is set */
-	char* i_serialport = NULL;
-	if(serialport->count>0)
-		i_serialport = (char*)serialport->sval[0];
+		if (error != NULL) {
+			printf("%s: %s: %s\n", PROGNAME, serialport->sval[i], error);
+			exitcode=1;
+			goto exit;
+		}
+	}
+	if(serialconf->count>0) {
+		if (read_serial_config(serialconf->filename[0]) < 0) {
+			exitcode=1;
+			goto exit;
+		}
+	}
 
 	/* check if baudrate is set */
-	int i_baudrate = -1;
-	if(baud->count>0)
-		i_baudrate = (int)baud->ival[0];
+	if(baud->count>0) {
+		opt.baud = (int)baud->ival[0];
+		if (opt.baud <= 0) {
+			printf("%s: --baud must be positive\n", PROGNAME);
+			exitcode=1;
+			goto exit;
+		}
+	}
 	
-	/* check if client ip is set */
-	char* i_client = NULL;
+	/* check if client ips are set */
+	static struct allowlist allowlist;
 	if(client->count>0) {
-		i_client = (char *)client->sval[0];
+		allow_init(&allowlist);
+		for (i = 0; i < client->count; i++) {
+			char *list = strdup(client->sval[i]), *save = NULL, *spec;
+
+			for (spec = strtok_r(list, ",", &save); spec != NULL; spec = strtok_r(NULL, ",", &save)) {
+				if (allow_add(&allowlist, spec) < 0) {
+					printf("%s: invalid client '%s'\n", PROGNAME, spec);
+					free(list);
+					exitcode=1;
+					goto exit;
+				}
+			}
+			free(list);
+		}
+		opt.allow = &allowlist;
 	}
 	
+	/* check if receive batch size is set */
+	if(batch->count>0) {
+		opt.batch = (int)batch->ival[0];
+		if (opt.batch < 1 || opt.batch > MAXBATCH) {
+			printf("%s: --batch must be between 1 and %i\n", PROGNAME, MAXBATCH);
+			exitcode=1;
+			goto exit;
+		}
+	}
+
+	/* check which I/O engine to use */
+	if(engine->count>0) {
+		opt.engine = (char *)engine->sval[0];
+		if (strcmp(opt.engine, "classic") != 0 && strcmp(opt.engine, "uring") != 0
+			&& strcmp(opt.engine, "uring-sqpoll") != 0 && strcmp(opt.engine, "xdp") != 0) {
+			printf("%s: unknown engine '%s'\n", PROGNAME, opt.engine);
+			exitcode=1;
+			goto exit;
+		}
+	}
+
+	/* check AF_XDP settings */
+	if(xdpif->count>0)
+		opt.xdp_if = (char *)xdpif->sval[0];
+	if(xdpqueue->count>0)
+		opt.xdp_queue = (int)xdpqueue->ival[0];
+	if (opt.engine != NULL && strcmp(opt.engine, "xdp") == 0 && opt.xdp_if == NULL) {
+		printf("%s: --engine xdp needs --xdp-if\n", PROGNAME);
+		exitcode=1;
+		goto exit;
+	}
+	if (opt.xdp_queue < 0 || opt.xdp_queue >= 64) {
+		printf("%s: --xdp-queue must be between 0 and 63\n", PROGNAME);
+		exitcode=1;
+		goto exit;
+	}
+
+	/* check serial output queue settings */
+	if(queuelen->count>0) {
+		opt.queuelen = (int)queuelen->ival[0];
+		if (opt.queuelen < 1 || opt.queuelen > 1048576) {
+			printf("%s: --queue must be between 1 and 1048576\n", PROGNAME);
+			exitcode=1;
+			goto exit;
+		}
+	}
+
+	if(highwater->count>0) {
+		opt.highwater = (int)highwater->ival[0];
+		if (opt.highwater < 1) {
+			printf("%s: --highwater must be at least 1\n", PROGNAME);
+			exitcode=1;
+			goto exit;
+		}
+	}
+
+	if(drop->count>0) {
+		if (strcmp(drop->sval[0], "oldest") == 0) {
+			opt.drop_policy = DROP_OLDEST;
+		} else if (strcmp(drop->sval[0], "newest") != 0) {
+			printf("%s: unknown drop policy '%s'\n", PROGNAME, drop->sval[0]);
+			exitcode=1;
+			goto exit;
+		}
+	}
+
+	/* check link pacing */
+	if(pace->count>0) {
+		opt.pace = (int)pace->ival[0];
+		if (opt.pace < 1 || opt.pace > 100) {
+			printf("%s: --pace must be between 1 and 100\n", PROGNAME);
+			exitcode=1;
+			goto exit;
+		}
+	}
+
+	/* check writer threads */
+	for (i = 0; i < writercpu->count; i++) {
+		if (writercpu->ival[i] < 0 || writercpu->ival[i] >= CPU_SETSIZE) {
+			printf("%s: --writer-cpu must be between 0 and %i\n", PROGNAME, CPU_SETSIZE - 1);
+			exitcode=1;
+			goto exit;
+		}
+	}
+
+	/* check receive workers */
+	if(nworkers->count>0) {
+		opt.nwork = (int)nworkers->ival[0];
+		if (opt.nwork < 1 || opt.nwork > MAXWORKERS) {
+			printf("%s: --workers must be between 1 and %i\n", PROGNAME, MAXWORKERS);
+			exitcode=1;
+			goto exit;
+		}
+		if (opt.engine != NULL && strcmp(opt.engine, "classic") != 0) {
+			printf("%s: --workers only works with the classic engine\n", PROGNAME);
+			exitcode=1;
+			goto exit;
+		}
+	}
+	for (i = 0; i < workercpu->count; i++) {
+		if (workercpu->ival[i] < 0 || workercpu->ival[i] >= CPU_SETSIZE) {
+			printf("%s: --worker-cpu must be between 0 and %i\n", PROGNAME, CPU_SETSIZE - 1);
+			exitcode=1;
+			goto exit;
+		}
+	}
+	if (workercpu->count > 0 && opt.nwork == 0) {
+		printf("%s: --worker-cpu needs --workers\n", PROGNAME);
+		exitcode=1;
+		goto exit;
+	}
+
+	/* check the unix socket */
+	if(unixsock->count>0)
+		opt.unixpath = (char *)unixsock->sval[0];
+	if(unixmode->count>0) {
+		char *end;
+
+		opt.unixmode = (int)strtol(unixmode->sval[0], &end, 8);
+		if (*unixmode->sval[0] == '\0' || *end != '\0' || opt.unixmode < 0 || opt.unixmode > 0777) {
+			printf("%s: --unix-mode must be octal permissions like 0660\n", PROGNAME);
+			exitcode=1;
+			goto exit;
+		}
+		if (opt.unixpath == NULL) {
+			printf("%s: --unix-mode needs --unix\n", PROGNAME);
+			exitcode=1;
+			goto exit;
+		}
+	}
+
+	/* check the shared memory ring */
+	if(shm->count>0) {
+		opt.shmname = (char *)shm->sval[0];
+		if (opt.shmname[0] != '/' || strchr(opt.shmname + 1, '/') != NULL || strlen(opt.shmname) > NAME_MAX) {
+			printf("%s: --shm must be a name like /eiwomisa\n", PROGNAME);
+			exitcode=1;
+			goto exit;
+		}
+	}
+	if(shmsize->count>0) {
+		opt.shmsize = (int)shmsize->ival[0];
+		if (opt.shmsize < 1 || opt.shmsize > 16777216) {
+			printf("%s: --shm-size must be between 1 and 16777216\n", PROGNAME);
+			exitcode=1;
+			goto exit;
+		}
+		/* the ring wants a power of 2 */
+		for (i = 1; i < opt.shmsize; i <<= 1)
+			;
+		opt.shmsize = i;
+	}
+	if(shmpoll->count>0) {
+		opt.shmpoll = (int)shmpoll->ival[0];
+		if (opt.shmpoll < 0 || opt.shmpoll > 1000) {
+			printf("%s: --shm-poll must be between 0 and 1000\n", PROGNAME);
+			exitcode=1;
+			goto exit;
+		}
+	}
+	if ((shmsize->count > 0 || shmpoll->count > 0) && opt.shmname == NULL) {
+		printf("%s: --shm-size and --shm-poll need --shm\n", PROGNAME);
+		exitcode=1;
+		goto exit;
+	}
+
+	/* check TCP ingest */
+	if(tcpport->count>0) {
+		opt.tcpport = (int)tcpport->ival[0];
+		if (opt.tcpport < 1 || opt.tcpport > 65535) {
+			printf("%s: --tcp must be a port between 1 and 65535\n", PROGNAME);
+			exitcode=1;
+			goto exit;
+		}
+	}
+	if(tcpmax->count>0) {
+		opt.tcpmax = (int)tcpmax->ival[0];
+		if (opt.tcpmax < 1 || opt.tcpmax > 4096) {
+			printf("%s: --tcp-max must be between 1 and 4096\n", PROGNAME);
+			exitcode=1;
+			goto exit;
+		}
+		if (opt.tcpport == 0) {
+			printf("%s: --tcp-max needs --tcp\n", PROGNAME);
+			exitcode=1;
+			goto exit;
+		}
+	}
+
+	/* check the metrics endpoint */
+	if(metricsaddr->count>0) {
+		opt.metricsaddr = (char *)metricsaddr->sval[0];
+		if (opt.metricsaddr[0] != '/'
+			&& (atoi(opt.metricsaddr) < 1 || atoi(opt.metricsaddr) > 65535
+				|| strspn(opt.metricsaddr, "0123456789") != strlen(opt.metricsaddr))) {
+			printf("%s: --metrics must be a port or an absolute unix socket path\n", PROGNAME);
+			exitcode=1;
+			goto exit;
+		}
+	}
+
+	/* check redundant frame suppression */
+	if(refresh->count>0) {
+		opt.refresh = (int)refresh->ival[0];
+		if (opt.refresh < 1) {
+			printf("%s: --refresh must be at least 1 second\n", PROGNAME);
+			exitcode=1;
+			goto exit;
+		}
+	}
+
+	/* check per client rate limit */
+	if(rate->count>0) {
+		int i_burst = (int)rate->ival[0];
+
+		if (rate->ival[0] < 1 || rate->ival[0] > 1000000) {
+			printf("%s: --rate must be between 1 and 1000000\n", PROGNAME);
+			exitcode=1;
+			goto exit;
+		}
+		if (burst->count>0) {
+			i_burst = (int)burst->ival[0];
+			if (i_burst < 1) {
+				printf("%s: --burst must be at least 1\n", PROGNAME);
+				exitcode=1;
+				goto exit;
+			}
+		}
+		ratelimit_init(&ratelimit, rate->ival[0], i_burst);
+	} else if (burst->count>0) {
+		printf("%s: --burst needs --rate\n", PROGNAME);
+		exitcode=1;
+		goto exit;
+	}
+
+	/* check fair scheduling */
+	for (i = 0; i < weight->count; i++) {
+		char ip[INET_ADDRSTRLEN];
+		struct in_addr in;
+		int w, n;
+
+		if (sscanf(weight->sval[i], "%15[0-9.]=%i%n", ip, &w, &n) != 2 || weight->sval[i][n] != '\0'
+			|| inet_pton(AF_INET, ip, &in) < 1 || w < 1 || w > 1000) {
+			printf("%s: --weight must be client=n with n between 1 and 1000\n", PROGNAME);
+			exitcode=1;
+			goto exit;
+		}
+		drr_weights[drr_nweights].addr = in.s_addr;
+		drr_weights[drr_nweights].weight = w;
+		drr_nweights++;
+	}
+	if ((fair->count > 0 || weight->count > 0) && coalesce->count > 0) {
+		printf("%s: --fair and --coalesce can't be used together\n", PROGNAME);
+		exitcode=1;
+		goto exit;
+	}
+	if ((fair->count > 0 || weight->count > 0) && opt.nwork > 0) {
+		printf("%s: --fair and --workers can't be used together\n", PROGNAME);
+		exitcode=1;
+		goto exit;
+	}
+	if (fair->count > 0 || weight->count > 0) {
+		/* --queue and --highwater are per client, each of DRR_FLOWS */
+		if (queuelen->count == 0) {
+			opt.queuelen = DRR_FLOWLEN;
+		} else if (opt.queuelen > DRR_MAXFLOWLEN) {
+			printf("%s: with --fair --queue must be at most %i\n", PROGNAME, DRR_MAXFLOWLEN);
+			exitcode=1;
+			goto exit;
+		}
+	}
+
+	/* check if statistics interval is set */
+	if(statsint->count>0) {
+		stats_interval = (int)statsint->ival[0];
+	}
+	if(latencyopt->count>0) {
+		if (stats_interval <= 0) {
+			printf("%s: --latency needs --stats\n", PROGNAME);
+			exitcode=1;
+			goto exit;
+		}
+		latency_enabled = 1;
+	}
+
 	/* --debug enables debug messages */
     if (debug->count > 0) {
-		printf("debug messages enabled\n");
+		if (EIWOMISA_MAX_LOGLEVEL < 3)
+			printf("debug messages are not compiled in\n");
+		else
+			printf("debug messages enabled\n");
 		msglevel = 3;
 	}
 
@@ -395,7 +1222,23 @@ int main(int argc, char **argv)
 		msglevel = 0;
 	}
 
-	exitcode = mymain(i_serverport, i_serialport, i_baudrate, i_client);
+	/* from here on a thread prints the messages */
+	if (msglevel > 0) {
+		msg_start();
+	}
+
+	/* switches that need nothing checked */
+	opt.coalesce = coalesce->count > 0;
+	opt.threaded = writerthread->count > 0 || writercpu->count > 0;
+	opt.cpus = writercpu->ival;
+	opt.ncpus = writercpu->count;
+	opt.suppress = suppress->count > 0 || refresh->count > 0;
+	opt.fair = fair->count > 0 || weight->count > 0;
+	opt.kernelfilter = kernelfilter->count > 0;
+	opt.wcpus = workercpu->ival;
+	opt.nwcpus = workercpu->count;
+
+	exitcode = mymain(&opt);
 
 exit:
     /* deallocate each non-null entry in argtable[] */
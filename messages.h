@@ -21,48 +21,420 @@
  *****************************************************************************/
 
 #include <stdarg.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+
+/* The msg_* functions don't format anything themselves. They copy the
+ * format pointer and the raw arguments into a fixed size record in a
+ * ring, and a logger thread turns the records into text. Format strings
+ * must be literals, which they all are; %s arguments are copied since
+ * they often live in a static buffer (inet_ntoa()). When the ring is
+ * full the message is counted in msg_dropped and lost.
+ *
+ * The ring is Vyukov's bounded queue: any thread claims a slot by
+ * moving tail, fills it and publishes it through the slot's sequence
+ * number. The logger sleeps on an eventfd when it runs dry and says so
+ * in msg_sleeping, so callers only make a system call to wake it.
+ * Until msg_start() everything is printed right away. */
+
+#define MSG_SLOTS 4096
+#define MSG_DATA 112	/* argument bytes per record */
+
+struct msg_record {
+	unsigned int seq;
+	unsigned char level;
+	unsigned char len;	/* bytes used in data */
+	const char *fmt;
+	unsigned char data[MSG_DATA];
+};
 
 /* parse msglevel parameter, default 2 = error&info messages */
 int msglevel = 2;
 
-void msg_Dbg(char *fmt, ...)
+struct msg_record *msg_ring;
+unsigned int msg_tail;		/* next slot to claim, any thread */
+unsigned int msg_head;		/* next slot to print, logger thread */
+int msg_sleeping;
+int msg_stop;
+int msg_efd = -1;
+pthread_t msg_thread;
+unsigned long msg_dropped;	/* lost to a full ring */
+
+static const char *msg_prefix[] = { "", "ERROR: ", "info: ", "debug: " };
+
+/* length of the conversion spec at fmt (just after the '%'), stores the
+ * conversion character and how many 'l's / a 'z' modify it */
+int msg_spec(const char *fmt, char *conv, int *longs)
 {
-	if (msglevel>2) {
-		va_list argp;
-		printf("debug: ");
-		va_start(argp, fmt);
-		vprintf(fmt, argp);
-		va_end(argp);
-		printf("\n");
+	const char *p = fmt;
+
+	*longs = 0;
+	while (*p != '\0' && strchr("-+ #0123456789.*", *p) != NULL)
+		p++;
+	for (; *p == 'l' || *p == 'z' || *p == 'h'; p++) {
+		if (*p != 'h')
+			(*longs)++;
 	}
+	*conv = *p;
+	return p - fmt + (*p != '\0');
 }
 
-void msg_Info(char *fmt, ...)
+/* copy the arguments fmt refers to into rec->data,
+ * returns -1 if they don't fit */
+int msg_pack(struct msg_record *rec, const char *fmt, va_list ap)
 {
-	if (msglevel>1) {
-		va_list argp;
-		printf("info: ");
-		va_start(argp, fmt);
-		vprintf(fmt, argp);
-		va_end(argp);
-		printf("\n");
+	unsigned char *data = rec->data;
+	unsigned int len = 0;
+	const char *p;
+	char conv;
+	int longs;
+
+	for (p = fmt; (p = strchr(p, '%')) != NULL; ) {
+		const char *spec = ++p, *q;
+		int precision = -1;
+
+		p += msg_spec(p, &conv, &longs);
+
+		/* '*' width or precision takes an int of its own */
+		for (q = spec; q < p; q++) {
+			if (*q == '*') {
+				int star = va_arg(ap, int);
+
+				if (len + sizeof(int) > MSG_DATA)
+					return -1;
+				memcpy(data + len, &star, sizeof(int));
+				len += sizeof(int);
+				if (q > spec && q[-1] == '.')
+					precision = star;
+			} else if (*q == '.' && q[1] >= '0' && q[1] <= '9') {
+				precision = atoi(q + 1);
+			}
+		}
+
+		switch (conv) {
+		case 's': {
+			const char *s = va_arg(ap, const char *);
+			size_t n;
+
+			if (s == NULL)
+				s = "(null)";
+			n = precision >= 0 ? strnlen(s, precision) : strlen(s);
+			if (len + n + 1 > MSG_DATA)
+				n = MSG_DATA - len - 1;
+			if (len >= MSG_DATA)
+				return -1;
+			memcpy(data + len, s, n);
+			data[len + n] = '\0';
+			len += n + 1;
+			break;
+		}
+		case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': {
+			double d = va_arg(ap, double);
+
+			if (len + sizeof(d) > MSG_DATA)
+				return -1;
+			memcpy(data + len, &d, sizeof(d));
+			len += sizeof(d);
+			break;
+		}
+		case 'd': case 'i': case 'c': case 'p': case 'u': case 'x': case 'X': case 'o': {
+			unsigned long long v;
+
+			if (conv == 'p')
+				v = (uintptr_t)va_arg(ap, void *);
+			else if (strchr("dic", conv) != NULL)
+				v = longs >= 2 ? va_arg(ap, long long)
+					: longs == 1 ? va_arg(ap, long) : va_arg(ap, int);
+			else
+				v = longs >= 2 ? va_arg(ap, unsigned long long)
+					: longs == 1 ? va_arg(ap, unsigned long) : va_arg(ap, unsigned int);
+			if (len + sizeof(v) > MSG_DATA)
+				return -1;
+			memcpy(data + len, &v, sizeof(v));
+			len += sizeof(v);
+			break;
+		}
+		default:	/* %% */
+			break;
+		}
+	}
+	rec->len = len;
+	return 0;
+}
+
+/* logger thread: print a record the way vprintf() would have */
+void msg_format(FILE *out, struct msg_record *rec)
+{
+	const unsigned char *data = rec->data;
+	const char *p = rec->fmt, *start;
+	char spec[32], conv;
+	int longs;
+
+	fputs(msg_prefix[rec->level], out);
+	while ((start = strchr(p, '%')) != NULL) {
+		int n, stars[2], nstars = 0;
+		const char *q;
+
+		fwrite(p, 1, start - p, out);
+		n = msg_spec(start + 1, &conv, &longs) + 1;
+		p = start + n;
+		if (conv == '%') {
+			fputc('%', out);
+			continue;
+		}
+		if (n >= (int)sizeof(spec))
+			n = sizeof(spec) - 1;
+		memcpy(spec, start, n);
+		spec[n] = '\0';
+
+		for (q = spec; *q != '\0'; q++) {
+			if (*q == '*' && nstars < 2) {
+				memcpy(&stars[nstars++], data, sizeof(int));
+				data += sizeof(int);
+			}
+		}
+
+		switch (conv) {
+		case 's':
+			if (nstars == 0)
+				fprintf(out, spec, (const char *)data);
+			else if (nstars == 1)
+				fprintf(out, spec, stars[0], (const char *)data);
+			else
+				fprintf(out, spec, stars[0], stars[1], (const char *)data);
+			data += strlen((const char *)data) + 1;
+			break;
+		case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': {
+			double d;
+
+			memcpy(&d, data, sizeof(d));
+			data += sizeof(d);
+			if (nstars == 0)
+				fprintf(out, spec, d);
+			else if (nstars == 1)
+				fprintf(out, spec, stars[0], d);
+			else
+				fprintf(out, spec, stars[0], stars[1], d);
+			break;
+		}
+		case 'd': case 'i': case 'c': case 'p': case 'u': case 'x': case 'X': case 'o': {
+			unsigned long long v;
+
+			memcpy(&v, data, sizeof(v));
+			data += sizeof(v);
+			if (conv == 'c') {
+				fputc((int)v, out);
+				break;
+			}
+			if (conv == 'p')
+				fputs("0x", out);
+
+			/* every integer was stored as long long, keep flags and width */
+			snprintf(spec, sizeof(spec), "%.*sll%c", (int)strcspn(spec, "lzhdiuxXop"),
+					 start, conv == 'p' ? 'x' : conv);
+			if (nstars == 0)
+				fprintf(out, spec, v);
+			else if (nstars == 1)
+				fprintf(out, spec, stars[0], v);
+			else
+				fprintf(out, spec, stars[0], stars[1], v);
+			break;
+		}
+		default:
+			fputs(spec, out);
+			break;
+		}
 	}
+	fputs(p, out);
+	fputc('\n', out);
 }
 
-void msg_Err(char *fmt, ...)
+/* queue a message, or print it if there is no logger thread */
+void msg_log(int level, const char *fmt, va_list ap)
 {
-	if (msglevel>0) {
-		va_list argp;
-		printf("ERROR: ");
-		va_start(argp, fmt);
-		vprintf(fmt, argp);
-		va_end(argp);
+	struct msg_record *rec;
+	unsigned int pos, seq;
+	uint64_t one = 1;
+
+	if (msg_ring == NULL) {
+		printf("%s", msg_prefix[level]);
+		vprintf(fmt, ap);
 		printf("\n");
+		return;
+	}
+
+	pos = __atomic_load_n(&msg_tail, __ATOMIC_RELAXED);
+	for (;;) {
+		rec = &msg_ring[pos & (MSG_SLOTS - 1)];
+		seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+		if ((int)(seq - pos) == 0) {
+			if (__atomic_compare_exchange_n(&msg_tail, &pos, pos + 1, 1,
+											__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if ((int)(seq - pos) < 0) {
+			__atomic_fetch_add(&msg_dropped, 1, __ATOMIC_RELAXED);
+			return;
+		} else {
+			pos = __atomic_load_n(&msg_tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	rec->level = level;
+	rec->fmt = fmt;
+	if (msg_pack(rec, fmt, ap) < 0) {
+		/* arguments too big, keep at least the format */
+		rec->fmt = "%s (message too long)";
+		rec->len = 0;
+		snprintf((char *)rec->data, MSG_DATA, "%s", fmt);
+	}
+	__atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&msg_sleeping, __ATOMIC_RELAXED)
+		&& __atomic_exchange_n(&msg_sleeping, 0, __ATOMIC_RELAXED)) {
+		if (write(msg_efd, &one, sizeof(one)) < 0)
+			return;
+	}
+}
+
+/* logger thread: print everything queued, returns 0 if there was nothing */
+int msg_drain(FILE *out)
+{
+	static unsigned long reported;
+	struct msg_record *rec;
+	unsigned long dropped;
+	int n = 0;
+
+	for (;;) {
+		rec = &msg_ring[msg_head & (MSG_SLOTS - 1)];
+		if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != msg_head + 1)
+			break;
+		msg_format(out, rec);
+		__atomic_store_n(&rec->seq, msg_head + MSG_SLOTS, __ATOMIC_RELEASE);
+		msg_head++;
+		n++;
+	}
+
+	dropped = __atomic_load_n(&msg_dropped, __ATOMIC_RELAXED);
+	if (dropped != reported) {
+		fprintf(out, "%s%lu messages dropped, log ring full\n", msg_prefix[1], dropped - reported);
+		reported = dropped;
+	}
+	if (n > 0)
+		fflush(out);
+	return n;
+}
+
+void *msg_thread_main(void *arg)
+{
+	uint64_t count;
+
+	for (;;) {
+		if (msg_drain(stdout) > 0)
+			continue;
+
+		/* say we sleep, then look once more before we do */
+		__atomic_store_n(&msg_sleeping, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (msg_drain(stdout) > 0) {
+			__atomic_store_n(&msg_sleeping, 0, __ATOMIC_RELAXED);
+			continue;
+		}
+		if (__atomic_load_n(&msg_stop, __ATOMIC_ACQUIRE))
+			break;
+		if (read(msg_efd, &count, sizeof(count)) < 0 && errno != EINTR)
+			break;
+	}
+	return NULL;
+}
+
+/* print what is left and stop the logger, also run by exit() */
+void msg_finish(void)
+{
+	uint64_t one = 1;
+
+	if (msg_ring == NULL)
+		return;
+
+	__atomic_store_n(&msg_stop, 1, __ATOMIC_RELEASE);
+	if (write(msg_efd, &one, sizeof(one)) == sizeof(one))
+		pthread_join(msg_thread, NULL);
+	msg_drain(stdout);
+	fflush(stdout);
+	msg_ring = NULL;
+}
+
+/* hand the messages to a logger thread from now on */
+void msg_start(void)
+{
+	sigset_t all, old;
+	unsigned int i;
+
+	msg_ring = calloc(MSG_SLOTS, sizeof(struct msg_record));
+	msg_efd = eventfd(0, EFD_CLOEXEC);
+	if (msg_ring == NULL || msg_efd < 0) {
+		free(msg_ring);
+		msg_ring = NULL;
+		return;
+	}
+	for (i = 0; i < MSG_SLOTS; i++) {
+		msg_ring[i].seq = i;
 	}
+
+	/* signals belong to the event loop, not to the logger */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	if (pthread_create(&msg_thread, NULL, msg_thread_main, NULL) != 0) {
+		free(msg_ring);
+		msg_ring = NULL;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (msg_ring != NULL)
+		atexit(msg_finish);
+}
+
+/* highest level compiled in, build with -DEIWOMISA_MAX_LOGLEVEL=2 to drop
+ * every debug message from the binary */
+#ifndef EIWOMISA_MAX_LOGLEVEL
+#define EIWOMISA_MAX_LOGLEVEL 3
+#endif
+
+/* the arguments end up in a binary record, let gcc check them */
+void msg_print(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+void msg_print(int level, const char *fmt, ...)
+{
+	va_list argp;
+
+	va_start(argp, fmt);
+	msg_log(level, fmt, argp);
+	va_end(argp);
 }
 
+/* the level is checked before the arguments are evaluated, a disabled
+ * message costs a load and a branch, a compiled out one nothing. Errors
+ * and info are on by default, only debug messages are unlikely. */
+#define msg_enabled(level) \
+	((level) >= 3 ? __builtin_expect(msglevel >= (level), 0) : msglevel >= (level))
+
+#define msg_level(level, ...) \
+	do { \
+		if (EIWOMISA_MAX_LOGLEVEL >= (level) && msg_enabled(level)) \
+			msg_print((level), __VA_ARGS__); \
+	} while (0)
+
+#define msg_Dbg(...) msg_level(3, __VA_ARGS__)
+#define msg_Info(...) msg_level(2, __VA_ARGS__)
+#define msg_Err(...) msg_level(1, __VA_ARGS__)
+
 void die(char *message)
 {
+	int error = errno;
+
+	msg_finish();
+	errno = error;
 	perror(message);
 	exit(1);
 }
@@ -0,0 +1,272 @@
+/*****************************************************************************
+ * metrics.h: Prometheus text endpoint
+ *****************************************************************************
+ * Copyright (C) 2011 Kai Hermann
+ *
+ * Authors: Kai Hermann <kai.uwe.hermann at gmail dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/* --metrics serves the counters in the Prometheus text format over HTTP,
+ * on a port of 127.0.0.1 or on a unix socket, from the main event loop.
+ * Counting stays what it was: stats_inc() or rxstats_inc() into a set of
+ * counters per thread. A scrape adds the sets up (stats_sum()), so the
+ * hot path never pays for the endpoint. A connection is answered once
+ * its request is complete and closed after the response. */
+
+#include <sys/un.h>
+
+#define METRICS_MAXCONNS 8
+#define METRICS_REQSIZE 1024
+#define METRICS_BUFSIZE 32768
+#define METRICS_MODE 0660	/* permissions of a unix metrics socket */
+
+struct metrics_conn {
+	int fd;			/* -1 = slot free */
+	struct handler h;
+	uint64_t since;		/* accept() time, the oldest goes first when full */
+	char req[METRICS_REQSIZE];
+	unsigned int reqlen;
+	char resp[METRICS_BUFSIZE];
+	unsigned int resplen;
+	unsigned int sent;
+};
+
+struct metrics {
+	int sock;
+	const char *path;	/* unix socket, or NULL */
+	struct handler h;
+	struct metrics_conn conns[METRICS_MAXCONNS];
+	unsigned long scrapes;
+};
+
+struct metrics metrics = { .sock = -1 };
+
+/* append to the response, silently cut at METRICS_BUFSIZE */
+void metrics_printf(struct metrics_conn *c, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	if (c->resplen >= METRICS_BUFSIZE)
+		return;
+	va_start(ap, fmt);
+	n = vsnprintf(c->resp + c->resplen, METRICS_BUFSIZE - c->resplen, fmt, ap);
+	va_end(ap);
+	if (n > 0)
+		c->resplen += n;
+	if (c->resplen > METRICS_BUFSIZE)
+		c->resplen = METRICS_BUFSIZE;
+}
+
+void metrics_header(struct metrics_conn *c, const char *name, const char *type, const char *help)
+{
+	metrics_printf(c, "# HELP eiwomisa_%s %s\n# TYPE eiwomisa_%s %s\n", name, help, name, type);
+}
+
+/* the metrics page itself */
+void metrics_render(struct metrics_conn *c)
+{
+	unsigned int i;
+	int p;
+
+	for (i = 0; i < STATS_NFIELDS; i++) {
+		char name[64];
+
+		snprintf(name, sizeof(name), "%s_total", stats_fields[i].name);
+		metrics_header(c, name, "counter", stats_fields[i].help);
+		metrics_printf(c, "eiwomisa_%s %lu\n", name, stats_sum(&stats_fields[i]));
+	}
+
+	metrics_header(c, "log_messages_dropped_total", "counter", "Messages lost to a full log ring");
+	metrics_printf(c, "eiwomisa_log_messages_dropped_total %lu\n",
+				   __atomic_load_n(&msg_dropped, __ATOMIC_RELAXED));
+
+	metrics_header(c, "port_frames_written_total", "counter", "Frames written per serial port");
+	for (p = 0; p < nports; p++) {
+		metrics_printf(c, "eiwomisa_port_frames_written_total{port=\"%s\"} %lu\n",
+					   ports[p].path, __atomic_load_n(&ports[p].written, __ATOMIC_RELAXED));
+	}
+
+	metrics_header(c, "port_queue_frames", "gauge", "Frames in the output queue of a serial port");
+	for (p = 0; p < nports; p++) {
+		metrics_printf(c, "eiwomisa_port_queue_frames{port=\"%s\"} %u\n",
+					   ports[p].path, serial_queued(&ports[p]));
+	}
+
+	metrics_header(c, "link_capacity_frames_per_second", "gauge", "Frames/s the baud rates can carry");
+	metrics_printf(c, "eiwomisa_link_capacity_frames_per_second %.1f\n", stats.link_capacity);
+
+	metrics_header(c, "tcp_connections", "gauge", "Open --tcp connections");
+	metrics_printf(c, "eiwomisa_tcp_connections %u\n", tcpingest.nconns);
+}
+
+void metrics_close(struct metrics_conn *c)
+{
+	reactor_del(&c->h);
+	close(c->fd);
+	c->fd = -1;
+}
+
+/* send what is left of the response, close when done */
+void metrics_send(struct metrics_conn *c)
+{
+	int n;
+
+	while (c->sent < c->resplen) {
+		n = write(c->fd, c->resp + c->sent, c->resplen - c->sent);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				reactor_mod(&c->h, EPOLLOUT);
+				return;
+			}
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		c->sent += n;
+	}
+	metrics_close(c);
+}
+
+/* answer a complete request */
+void metrics_respond(struct metrics_conn *c)
+{
+	static const char header[] = "HTTP/1.0 200 OK\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n"
+		"Connection: close\r\n\r\n";
+	static const char notfound[] = "HTTP/1.0 404 Not Found\r\n"
+		"Content-Type: text/plain\r\n"
+		"Connection: close\r\n\r\n"
+		"try /metrics\n";
+
+	c->resplen = c->sent = 0;
+	if (strncmp(c->req, "GET /metrics ", 13) == 0 || strncmp(c->req, "GET / ", 6) == 0) {
+		metrics_printf(c, "%s", header);
+		metrics_render(c);
+		metrics.scrapes++;
+	} else {
+		metrics_printf(c, "%s", notfound);
+	}
+	metrics_send(c);
+}
+
+void metrics_conn_event(struct handler *h, unsigned int events)
+{
+	struct metrics_conn *c = h->arg;
+	int n;
+
+	if (c->h.events & EPOLLOUT) {
+		metrics_send(c);
+		return;
+	}
+
+	n = read(c->fd, c->req + c->reqlen, METRICS_REQSIZE - 1 - c->reqlen);
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return;
+	if (n <= 0) {
+		metrics_close(c);
+		return;
+	}
+	c->reqlen += n;
+	c->req[c->reqlen] = '\0';
+
+	/* we only look at the request line, but wait for the whole header */
+	if (strstr(c->req, "\r\n\r\n") != NULL || strstr(c->req, "\n\n") != NULL
+		|| c->reqlen == METRICS_REQSIZE - 1)
+		metrics_respond(c);
+}
+
+void metrics_accept_event(struct handler *h, unsigned int events)
+{
+	struct metrics *m = h->arg;
+	struct metrics_conn *c;
+	int fd, i;
+
+	while ((fd = accept4(m->sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		/* a free slot, or the one waiting the longest */
+		c = &m->conns[0];
+		for (i = 0; i < METRICS_MAXCONNS && m->conns[i].fd >= 0; i++) {
+			if (m->conns[i].since < c->since)
+				c = &m->conns[i];
+		}
+		if (i < METRICS_MAXCONNS)
+			c = &m->conns[i];
+		else
+			metrics_close(c);
+
+		c->fd = fd;
+		c->since = reactor_now();
+		c->reqlen = 0;
+		reactor_add(&c->h, fd, EPOLLIN, metrics_conn_event, c);
+	}
+}
+
+/* listen on addr: a port of 127.0.0.1, or a unix socket path */
+void metrics_start(struct metrics *m, const char *addr)
+{
+	int i, on = 1;
+
+	if (addr[0] == '/') {
+		if ((m->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+			die("Failed to create metrics socket\n");
+		}
+		if (unix_bind(m->sock, addr, METRICS_MODE) < 0) {
+			die("Failed to bind metrics socket\n");
+		}
+		m->path = addr;
+	} else {
+		struct sockaddr_in server;
+
+		if ((m->sock = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP)) < 0) {
+			die("Failed to create metrics socket\n");
+		}
+		setsockopt(m->sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		memset(&server, 0, sizeof(server));
+		server.sin_family = AF_INET;
+		server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		server.sin_port = htons(atoi(addr));
+		if (bind(m->sock, (struct sockaddr *) &server, sizeof(server)) < 0) {
+			die("Failed to bind metrics socket\n");
+		}
+	}
+
+	if (listen(m->sock, METRICS_MAXCONNS) < 0) {
+		die("Failed to listen on metrics socket\n");
+	}
+	for (i = 0; i < METRICS_MAXCONNS; i++) {
+		m->conns[i].fd = -1;
+	}
+	reactor_add(&m->h, m->sock, EPOLLIN, metrics_accept_event, m);
+	msg_Info("Serving metrics on %s%s", m->path != NULL ? "" : "127.0.0.1:", addr);
+}
+
+void metrics_stop(struct metrics *m)
+{
+	int i;
+
+	if (m->sock < 0)
+		return;
+
+	for (i = 0; i < METRICS_MAXCONNS; i++) {
+		if (m->conns[i].fd >= 0)
+			metrics_close(&m->conns[i]);
+	}
+	close(m->sock);
+	if (m->path != NULL)
+		unlink(m->path);
+	m->sock = -1;
+}
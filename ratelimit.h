@@ -0,0 +1,102 @@
+/*****************************************************************************
+ * ratelimit.h: per client token buckets
+ *****************************************************************************
+ * Copyright (C) 2011 Kai Hermann
+ *
+ * Authors: Kai Hermann <kai.uwe.hermann at gmail dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/* Every source address gets a token bucket of 'burst' frames refilled
+ * at 'rate' frames/s. A bucket is kept as the time it will be full
+ * again (GCRA), so a client costs 8 bytes of state and no refill work.
+ * The table has a fixed size and is allocated at startup; a new client
+ * that finds no free slot near its hash takes over the slot of the
+ * client that has been quiet the longest. */
+
+#define RATELIMIT_CLIENTS 1024	/* slots, power of 2 */
+#define RATELIMIT_PROBE 8	/* slots looked at per lookup */
+
+struct rl_client {
+	in_addr_t addr;		/* 0 = free */
+	uint64_t full_ns;	/* the bucket is full again at this time */
+};
+
+struct ratelimit {
+	struct rl_client *clients;
+	uint64_t interval_ns;	/* one token */
+	uint64_t burst_ns;	/* a full bucket */
+};
+
+/* --rate, clients == NULL if off; every receive worker has its own
+ * table, SO_REUSEPORT keeps a client on the same worker */
+__thread struct ratelimit ratelimit;
+
+void ratelimit_init(struct ratelimit *rl, int rate, int burst)
+{
+	rl->clients = calloc(RATELIMIT_CLIENTS, sizeof(struct rl_client));
+	if (rl->clients == NULL) {
+		die("Unable to allocate rate limit table");
+	}
+	rl->interval_ns = 1000000000ULL / rate;
+	rl->burst_ns = rl->interval_ns * burst;
+}
+
+/* same limits, empty table of its own */
+void ratelimit_clone(struct ratelimit *rl, const struct ratelimit *from)
+{
+	rl->clients = calloc(RATELIMIT_CLIENTS, sizeof(struct rl_client));
+	if (rl->clients == NULL) {
+		die("Unable to allocate rate limit table");
+	}
+	rl->interval_ns = from->interval_ns;
+	rl->burst_ns = from->burst_ns;
+}
+
+/* bucket of a source address (network byte order), once per datagram */
+struct rl_client *ratelimit_find(struct ratelimit *rl, in_addr_t addr)
+{
+	unsigned int i, slot = (addr * 2654435769U) >> 16;
+	struct rl_client *c, *oldest = NULL;
+
+	for (i = 0; i < RATELIMIT_PROBE; i++) {
+		c = &rl->clients[(slot + i) & (RATELIMIT_CLIENTS - 1)];
+		if (c->addr == addr)
+			return c;
+		if (c->addr == 0) {
+			oldest = c;
+			break;
+		}
+		if (oldest == NULL || c->full_ns < oldest->full_ns)
+			oldest = c;
+	}
+
+	/* new client, starts with a full bucket */
+	oldest->addr = addr;
+	oldest->full_ns = 0;
+	return oldest;
+}
+
+/* take a token for one frame, returns 0 if the bucket is empty */
+int ratelimit_take(struct ratelimit *rl, struct rl_client *c, uint64_t now)
+{
+	if (c->full_ns < now)
+		c->full_ns = now;
+	if (c->full_ns + rl->interval_ns > now + rl->burst_ns)
+		return 0;
+	c->full_ns += rl->interval_ns;
+	return 1;
+}
@@ -0,0 +1,210 @@
+/*****************************************************************************
+ * reactor.h: epoll event loop
+ *****************************************************************************
+ * Copyright (C) 2011 Kai Hermann
+ *
+ * Authors: Kai Hermann <kai.uwe.hermann at gmail dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+#define REACTOR_MAXEVENTS 64
+
+/* every fd in the loop is described by a handler, the callback gets
+ * the ready events (EPOLLIN, EPOLLOUT, ...) */
+struct handler;
+typedef void (*handler_cb)(struct handler *h, unsigned int events);
+
+struct handler {
+	int fd;
+	unsigned int events;	/* currently registered events */
+	handler_cb cb;
+	void *arg;
+};
+
+/* one loop per thread, serial writer threads run their own */
+__thread int reactor_fd = -1;
+__thread int reactor_running = 0;
+
+/* monotonic clock in nanoseconds */
+uint64_t reactor_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void reactor_init(void)
+{
+	reactor_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (reactor_fd < 0) {
+		die("Failed to create epoll instance");
+	}
+}
+
+/* register fd with the loop */
+void reactor_add(struct handler *h, int fd, unsigned int events,
+				 handler_cb cb, void *arg)
+{
+	struct epoll_event ev;
+
+	h->fd = fd;
+	h->events = events;
+	h->cb = cb;
+	h->arg = arg;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = h;
+	if (epoll_ctl(reactor_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		die("Failed to register fd with epoll");
+	}
+}
+
+/* change the events we are interested in, no-op if unchanged */
+void reactor_mod(struct handler *h, unsigned int events)
+{
+	struct epoll_event ev;
+
+	if (h->events == events)
+		return;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = h;
+	if (epoll_ctl(reactor_fd, EPOLL_CTL_MOD, h->fd, &ev) < 0) {
+		die("Failed to modify epoll registration");
+	}
+	h->events = events;
+}
+
+void reactor_del(struct handler *h)
+{
+	epoll_ctl(reactor_fd, EPOLL_CTL_DEL, h->fd, NULL);
+	h->events = 0;
+}
+
+/* create a periodic timerfd, interval in milliseconds */
+void reactor_add_timer(struct handler *h, long interval_ms,
+					   handler_cb cb, void *arg)
+{
+	struct itimerspec its;
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+	if (fd < 0) {
+		die("Failed to create timerfd");
+	}
+
+	memset(&its, 0, sizeof(its));
+	its.it_interval.tv_sec = interval_ms / 1000;
+	its.it_interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+	its.it_value = its.it_interval;
+	if (timerfd_settime(fd, 0, &its, NULL) < 0) {
+		die("Failed to arm timerfd");
+	}
+
+	reactor_add(h, fd, EPOLLIN, cb, arg);
+}
+
+/* create a one-shot timerfd, armed with reactor_arm_timer() */
+void reactor_add_oneshot(struct handler *h, handler_cb cb, void *arg)
+{
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+	if (fd < 0) {
+		die("Failed to create timerfd");
+	}
+	reactor_add(h, fd, EPOLLIN, cb, arg);
+}
+
+/* fire a one-shot timer at an absolute reactor_now() time */
+void reactor_arm_timer(struct handler *h, uint64_t when)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = when / 1000000000ULL;
+	its.it_value.tv_nsec = when % 1000000000ULL;
+	if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+		its.it_value.tv_nsec = 1;	/* zero would disarm */
+	timerfd_settime(h->fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/* acknowledge a timerfd expiration, returns the number of expirations */
+unsigned long reactor_timer_ack(struct handler *h)
+{
+	uint64_t expirations = 0;
+
+	if (read(h->fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return 0;
+	return (unsigned long)expirations;
+}
+
+/* route signals through a signalfd instead of asynchronous handlers */
+void reactor_add_signals(struct handler *h, const int *signals, int count,
+						 handler_cb cb, void *arg)
+{
+	sigset_t mask;
+	int i, fd;
+
+	sigemptyset(&mask);
+	for (i = 0; i < count; i++) {
+		sigaddset(&mask, signals[i]);
+	}
+
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
+		die("Failed to block signals");
+	}
+
+	fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (fd < 0) {
+		die("Failed to create signalfd");
+	}
+
+	reactor_add(h, fd, EPOLLIN, cb, arg);
+}
+
+/* wait up to timeout ms (-1 = forever) and dispatch one round of events */
+void reactor_poll(int timeout)
+{
+	struct epoll_event events[REACTOR_MAXEVENTS];
+	int i, n;
+
+	n = epoll_wait(reactor_fd, events, REACTOR_MAXEVENTS, timeout);
+	if (n < 0) {
+		if (errno == EINTR)
+			return;
+		die("epoll_wait() failed");
+	}
+
+	for (i = 0; i < n; i++) {
+		struct handler *h = events[i].data.ptr;
+		h->cb(h, events[i].events);
+	}
+}
+
+/* dispatch events until reactor_running is cleared */
+void reactor_run(void)
+{
+	reactor_running = 1;
+	while (reactor_running) {
+		reactor_poll(-1);
+	}
+}
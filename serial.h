@@ -0,0 +1,1037 @@
+/*****************************************************************************
+ * serial.h: RS-232 port handling
+ *****************************************************************************
+ * Copyright (C) 2009-2011 Kai Hermann
+ *
+ * Authors: Kai Hermann <kai.uwe.hermann at gmail dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+/* default number of frames waiting for the serial port to become
+ * writable, room for a few full datagrams */
+#define SERIAL_QUEUELEN 1024
+
+/* serial ports one server can drive */
+#define MAXPORTS 16
+
+/* 8N1: start bit, 8 data bits, stop bit */
+#define BITS_PER_BYTE 10
+
+/* what to do with a new frame when the queue reaches its high-water mark */
+#define DROP_NEWEST 0	/* discard the new frame */
+#define DROP_OLDEST 1	/* discard the oldest frame not yet handed to the tty */
+
+/* frames taken from the coalescer at once, everything still in the
+ * coalescer can be superseded by newer values */
+#define COALESCE_BURST 8
+
+/* shadow entry of a channel whose value on the controller is unknown,
+ * values only go up to 509 */
+#define SHADOW_UNKNOWN 0xffff
+
+/* how often to try reopening a port that hung up */
+#define SERIAL_RETRY_MS 1000
+
+/* frames a writer thread moves from its ring to the queue between flushes */
+#define SERIAL_THREAD_BATCH 64
+
+/* numeric baud rates and their termios speed constants */
+struct baudrate {
+	int baud;
+	speed_t speed;
+};
+
+const struct baudrate baudrates[] = {
+	{ 50, B50 }, { 75, B75 }, { 110, B110 }, { 134, B134 }, { 150, B150 },
+	{ 200, B200 }, { 300, B300 }, { 600, B600 }, { 1200, B1200 },
+	{ 1800, B1800 }, { 2400, B2400 }, { 4800, B4800 }, { 9600, B9600 },
+	{ 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 },
+	{ 115200, B115200 }, { 230400, B230400 }, { 460800, B460800 },
+	{ 500000, B500000 }, { 576000, B576000 }, { 921600, B921600 },
+	{ 1000000, B1000000 }, { 1152000, B1152000 }, { 1500000, B1500000 },
+	{ 2000000, B2000000 }, { 2500000, B2500000 }, { 3000000, B3000000 },
+	{ 3500000, B3500000 }, { 4000000, B4000000 },
+};
+
+/* speed constant for a baud rate, B0 if there is none */
+speed_t baud_to_speed(int pBaud)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(baudrates) / sizeof(baudrates[0]); i++) {
+		if (baudrates[i].baud == pBaud)
+			return baudrates[i].speed;
+	}
+	return B0;
+}
+
+/* Rates without a Bxxxx constant go through the kernel's termios2, which
+ * takes the rate as a number when CBAUD is BOTHER. glibc has no
+ * struct termios2 and <asm/termbits.h> clashes with <termios.h>, so we
+ * carry the kernel's layout ourselves. */
+struct serial_termios2 {
+	tcflag_t c_iflag;
+	tcflag_t c_oflag;
+	tcflag_t c_cflag;
+	tcflag_t c_lflag;
+	cc_t c_line;
+	cc_t c_cc[19];
+	speed_t c_ispeed;
+	speed_t c_ospeed;
+};
+
+#ifndef BOTHER
+#define BOTHER 0010000
+#endif
+#ifndef IBSHIFT
+#define IBSHIFT 16	/* input speed bits in c_cflag */
+#endif
+#define SERIAL_TCGETS2 _IOR('T', 0x2A, struct serial_termios2)
+#define SERIAL_TCSETS2 _IOW('T', 0x2B, struct serial_termios2)
+
+/* set an arbitrary baud rate, returns -1 if the driver doesn't take it */
+int set_custom_baudrate(int fd, int pBaud)
+{
+	struct serial_termios2 tio;
+
+	if (ioctl(fd, SERIAL_TCGETS2, &tio) < 0)
+		return -1;
+
+	tio.c_cflag &= ~CBAUD;
+	tio.c_cflag |= BOTHER;
+	tio.c_cflag &= ~(CBAUD << IBSHIFT);
+	tio.c_cflag |= BOTHER << IBSHIFT;
+	tio.c_ispeed = pBaud;
+	tio.c_ospeed = pBaud;
+	if (ioctl(fd, SERIAL_TCSETS2, &tio) < 0)
+		return -1;
+
+	/* the driver rounds to what its clock can do */
+	if (ioctl(fd, SERIAL_TCGETS2, &tio) == 0 && tio.c_ospeed != (speed_t)pBaud) {
+		msg_Info("baudrate %i set as %u", pBaud, tio.c_ospeed);
+	}
+	return 0;
+}
+
+/* raw 8N1 at pBaud on an open port
+ * returns NULL or what failed, errno tells why */
+const char *serial_configure(int fd, int pBaud)
+{
+	struct termios options;
+	speed_t speed = baud_to_speed(pBaud);
+	
+	/* stay non-blocking, a stalled adapter must never block the loop */
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	
+	/* get the current options for the port */
+	if (tcgetattr(fd, &options) < 0) {
+		return "Unable to read serial port settings";
+	}
+	
+	/* raw 8N1: no echo, no line editing, no signals, no CR/NL
+	 * translation and no software or hardware flow control */
+	cfmakeraw(&options);
+	options.c_cflag &= ~(CSTOPB | PARENB | CRTSCTS);
+	options.c_iflag &= ~(IXON | IXOFF | IXANY);
+	options.c_cc[VMIN] = 0;
+	options.c_cc[VTIME] = 0;
+	
+	/* enable the receiver and set local mode */
+	options.c_cflag |= (CLOCAL | CREAD);
+	
+	/* set baudrate */
+	if (speed != B0) {
+		cfsetispeed(&options, speed);
+		cfsetospeed(&options, speed);
+	}
+	
+	/* set the new options for the port */
+	if (tcsetattr(fd, TCSANOW, &options) < 0) {
+		return "Unable to set serial port settings";
+	}
+	
+	if (speed == B0) {
+		msg_Dbg("BAUDRATE %i has no speed constant, using termios2", pBaud);
+		if (set_custom_baudrate(fd, pBaud) < 0) {
+			return "Unable to set baudrate";
+		}
+	}
+	
+	/* whatever was pending belongs to the previous user */
+	tcflush(fd, TCIOFLUSH);
+	
+	msg_Dbg("BAUDRATE SET TO %i",pBaud);
+	return NULL;
+}
+
+/* open serial port
+ * returns the file descriptor on success or -1 on error */
+int open_port(const char *pPort, int pBaud)
+{
+	/* serial port file descriptor */
+	int fd = open(pPort, O_RDWR | O_NOCTTY | O_NDELAY);
+	const char *error;
+	
+	if(fd == -1) {
+		msg_Err("Unable to open serial-port");
+		msg_Info("Retrying in 5 seconds...");
+		sleep(5);
+		fd = open(pPort, O_RDWR | O_NOCTTY | O_NDELAY);
+	}
+	
+	if (fd == -1) {
+		die("Unable to open serial-port");
+	}
+	
+	error = serial_configure(fd, pBaud);
+	if (error != NULL) {
+		die((char *)error);
+	}
+	return (fd);
+}
+
+/* frames for the port live in a ring of size mask + 1 (a power of 2),
+ * head..tail are queued, the first 'pinned' of them have been handed to
+ * the kernel (a partially written frame, an io_uring chain) and must not
+ * be moved or dropped. --drop oldest doesn't close the gap it leaves,
+ * it turns the frame into a tombstone (start byte 0) that the writers
+ * skip; head never rests on one. */
+struct serialport {
+	int fd;
+	int index;			/* position in ports[] */
+	char *path;
+	unsigned int lo, hi;		/* channels routed to this port */
+	int ranged;			/* 0 = takes every channel no other port has */
+	struct handler h;
+	struct handler retry_h;		/* reopens the port after a hangup */
+	unsigned char (*queue)[BUFFSIZE];
+	uint64_t *stamps;		/* --latency: when each queued frame was validated */
+	unsigned int mask;
+	unsigned int head, tail;	/* tail - head = queued frames */
+	unsigned int offset;		/* bytes of queue[head] already written */
+	unsigned int pinned;		/* frames in flight, io_uring only */
+	unsigned int pin_end;		/* slot after the last frame in flight */
+	unsigned int cull;		/* slot --drop oldest looks at first */
+	unsigned int dead;		/* tombstones between head and tail */
+	unsigned int inflight;		/* sqes of the io_uring chain not yet completed */
+	unsigned int highwater;		/* apply drop_policy at this many frames */
+	int drop_policy;
+	struct coalescer *co;		/* latest value per channel, or NULL */
+	struct drr *drr;		/* one queue per client, or NULL */
+	struct chantable *ct;		/* filled by receive workers, or NULL */
+	struct handler ct_h;
+	unsigned short *shadow;		/* last value written per channel, or NULL */
+	long refresh_ms;		/* send the shadow again this often, 0 = never */
+	unsigned int refresh_pos;	/* next shadow entry of a refresh round */
+	struct handler refresh_h;
+	void (*flush)(struct serialport *sp);	/* engine specific writer */
+
+	/* link scheduler */
+	int baud;
+	uint64_t byte_ns;		/* time one byte needs on the wire */
+	uint64_t frame_ns;		/* paced interval between frames, 0 = no pacing */
+	uint64_t next_ns;		/* earliest start of the next frame */
+	struct handler timer_h;	/* wakes us up for the next slot */
+	int timer_armed;
+
+	unsigned long written;		/* frames written to this port */
+
+	/* --writer-thread: the receive loop only fills ring, the thread owns
+	 * everything above */
+	int threaded;
+	struct spsc ring;
+	int wake_fd;			/* eventfd, written only while the thread sleeps */
+	int sleeping;
+	int stop;
+	pthread_t thread;
+	struct handler wake_h;
+};
+
+struct serialport ports[MAXPORTS];
+int nports = 0;
+struct serialport *serial_default = NULL;	/* port without a channel range */
+
+/* add a port from "path[:baud[:first-last]]", baud -1 = use the default
+ * the fields are taken from the right and only when they look like one,
+ * paths such as /dev/serial/by-path/...-usb-0:1:1.0-port0 have colons of
+ * their own (end one with ':' if it ends in ":digits")
+ * returns NULL or what is wrong with the spec */
+const char *serial_add_spec(const char *spec)
+{
+	struct serialport *sp;
+	char *copy, *baud, *range;
+	const char *error = NULL;
+	unsigned int lo, hi;
+	int i, n;
+
+	if (nports >= MAXPORTS)
+		return "too many serial ports";
+
+	copy = strdup(spec);
+	if (copy == NULL)
+		die("Unable to allocate serial port");
+
+	sp = &ports[nports];
+	memset(sp, 0, sizeof(*sp));
+	sp->fd = -1;
+	sp->index = nports;
+	sp->baud = -1;
+	sp->lo = 0;
+	sp->hi = CHANNELS - 1;
+
+	range = strrchr(copy, ':');
+	if (range != NULL && sscanf(range + 1, "%u-%u%n", &lo, &hi, &n) == 2
+		&& range[1 + n] == '\0') {
+		*range = '\0';
+		if (lo > hi || hi >= CHANNELS) {
+			error = "channel range out of bounds";
+			goto fail;
+		}
+		sp->lo = lo;
+		sp->hi = hi;
+		sp->ranged = 1;
+	}
+
+	/* empty is the default baudrate, so "path::first-last" works */
+	baud = strrchr(copy, ':');
+	if (baud != NULL && baud[1 + strspn(baud + 1, "0123456789")] == '\0') {
+		*baud++ = '\0';
+		if (*baud != '\0') {
+			if (sscanf(baud, "%d", &sp->baud) != 1 || sp->baud <= 0) {
+				error = "invalid baudrate";
+				goto fail;
+			}
+		}
+	}
+
+	if (*copy == '\0') {
+		error = "missing device";
+		goto fail;
+	}
+
+	if (!sp->ranged && serial_default != NULL) {
+		error = "only one serial port may go without a channel range";
+		goto fail;
+	}
+
+	for (i = 0; i < nports; i++) {
+		if (sp->ranged && ports[i].ranged && sp->lo <= ports[i].hi && ports[i].lo <= sp->hi) {
+			error = "channel range overlaps another port";
+			goto fail;
+		}
+	}
+
+	if (!sp->ranged)
+		serial_default = sp;
+	sp->path = copy;
+	nports++;
+	return NULL;
+
+fail:
+	free(copy);
+	return error;
+}
+
+/* port that takes a channel, NULL if none does
+ * there are only a handful of ports, a linear scan beats anything clever */
+struct serialport *serial_route(unsigned int channel)
+{
+	int i;
+
+	for (i = 0; i < nports; i++) {
+		if (ports[i].ranged && channel >= ports[i].lo && channel <= ports[i].hi)
+			return &ports[i];
+	}
+	return serial_default;
+}
+
+/* i-th queued frame */
+unsigned char *serial_frame(struct serialport *sp, unsigned int i)
+{
+	return sp->queue[(sp->head + i) & sp->mask];
+}
+
+/* also read by stats and metrics while a writer thread moves the ring:
+ * head first, it never passes a tail read after it, and a count of
+ * tombstones that changed in between can't make it wrap */
+unsigned int serial_queued(struct serialport *sp)
+{
+	unsigned int head = __atomic_load_n(&sp->head, __ATOMIC_RELAXED);
+	unsigned int n = __atomic_load_n(&sp->tail, __ATOMIC_RELAXED) - head;
+	unsigned int dead = __atomic_load_n(&sp->dead, __ATOMIC_RELAXED);
+
+	return dead < n ? n - dead : 0;
+}
+
+#define SERIAL_TOMBSTONE 0	/* start byte of a dropped frame, valid ones have 255 */
+
+int serial_dead(struct serialport *sp, unsigned int slot)
+{
+	return sp->queue[slot & sp->mask][0] == SERIAL_TOMBSTONE;
+}
+
+/* step over dropped frames, head always points at a live one */
+void serial_settle(struct serialport *sp)
+{
+	while (sp->head != sp->tail && serial_dead(sp, sp->head)) {
+		sp->head++;
+		sp->dead--;
+	}
+}
+
+/* the frame at head is done with */
+void serial_advance(struct serialport *sp)
+{
+	sp->head++;
+	sp->offset = 0;
+	serial_settle(sp);
+}
+
+/* allocate the ring, rounded up to a power of 2 */
+void serial_init_queue(struct serialport *sp, unsigned int length,
+					   unsigned int highwater, int drop_policy)
+{
+	unsigned int size = 1;
+
+	while (size < length)
+		size <<= 1;
+
+	sp->queue = calloc(size, BUFFSIZE);
+	if (latency_enabled)
+		sp->stamps = calloc(size, sizeof(uint64_t));
+	if (sp->queue == NULL || (latency_enabled && sp->stamps == NULL)) {
+		die("Unable to allocate serial queue");
+	}
+	sp->mask = size - 1;
+	sp->head = sp->tail = sp->offset = sp->pinned = 0;
+	sp->pin_end = sp->cull = sp->dead = 0;
+	sp->highwater = (highwater > 0 && highwater < size) ? highwater : size;
+	sp->drop_policy = drop_policy;
+}
+
+/* the controller may not have the frame's value, let the next one through */
+void serial_forget(struct serialport *sp, const unsigned char *frame)
+{
+	if (sp->shadow != NULL)
+		sp->shadow[frame_channel(frame) - sp->lo] = SHADOW_UNKNOWN;
+}
+
+/* all of the frame is in the tty */
+void serial_sent(struct serialport *sp, const unsigned char *frame)
+{
+	if (sp->shadow != NULL)
+		sp->shadow[frame_channel(frame) - sp->lo] = frame_value(frame);
+}
+
+/* step over frames at head whose value the controller already has
+ * Only the head is compared: everything before it is written, so the
+ * shadow is exact there. */
+void serial_skip_redundant(struct serialport *sp)
+{
+	if (sp->shadow == NULL)
+		return;
+
+	while (sp->head != sp->tail && sp->offset == 0) {
+		unsigned char *frame = serial_frame(sp, 0);
+
+		if (sp->shadow[frame_channel(frame) - sp->lo] != frame_value(frame))
+			break;
+		stats_inc(suppressed);
+		serial_advance(sp);
+	}
+}
+
+/* a refresh round still has channels to send */
+int serial_refreshing(struct serialport *sp)
+{
+	return sp->shadow != NULL && sp->refresh_pos <= sp->hi - sp->lo;
+}
+
+/* queue the next known channel of a refresh round, returns 0 at the end
+ * of the round. Only called with nothing else waiting, so the shadow is
+ * the latest value of every channel and resending it reorders nothing. */
+unsigned int serial_refresh_next(struct serialport *sp)
+{
+	while (serial_refreshing(sp)) {
+		unsigned int i = sp->refresh_pos++;
+
+		if (sp->shadow[i] == SHADOW_UNKNOWN)
+			continue;
+
+		frame_build(sp->queue[sp->tail & sp->mask], sp->lo + i, sp->shadow[i]);
+		if (sp->stamps != NULL)
+			sp->stamps[sp->tail & sp->mask] = 0;
+		sp->tail++;
+		/* don't let serial_skip_redundant() take it, the write
+		 * puts the value back */
+		sp->shadow[i] = SHADOW_UNKNOWN;
+		return 1;
+	}
+	return 0;
+}
+
+/* drop the oldest frame that is not in the kernel's hands yet
+ * returns 0 if every queued frame is pinned
+ * This runs for every frame while we are over the high-water mark, so
+ * it must not touch the rest of the queue: the frame becomes a
+ * tombstone, and cull remembers where the next search starts. Slots
+ * before cull are tombstones or were handed to the kernel once. */
+int serial_drop_oldest(struct serialport *sp)
+{
+	unsigned int slot = sp->head + (sp->offset > 0);
+
+	if (sp->pinned > 0 && (int)(sp->pin_end - slot) > 0)
+		slot = sp->pin_end;
+	if ((int)(sp->cull - slot) > 0)
+		slot = sp->cull;
+
+	while (slot != sp->tail && serial_dead(sp, slot))
+		slot++;
+	if (slot == sp->tail)
+		return 0;
+
+	sp->queue[slot & sp->mask][0] = SERIAL_TOMBSTONE;
+	sp->dead++;
+	sp->cull = slot + 1;
+	serial_settle(sp);
+	return 1;
+}
+
+/* how many frames may start now
+ * Frames are spaced frame_ns apart so the tty never builds up a backlog;
+ * if it has one anyway (flow control, wrong baud), we wait until it is
+ * down to one frame. Arms the pacing timer and returns 0 if we have to
+ * wait. */
+unsigned int serial_pace(struct serialport *sp)
+{
+	uint64_t now, delay;
+	int outq = 0;
+
+	if (sp->frame_ns == 0)
+		return UINT_MAX;
+
+	now = reactor_now();
+
+	/* an idle link doesn't save up credit for a burst */
+	if (sp->next_ns + sp->frame_ns < now)
+		sp->next_ns = now - sp->frame_ns;
+
+	if (now >= sp->next_ns && ioctl(sp->fd, TIOCOUTQ, &outq) == 0) {
+		/* queueing delay inside the tty */
+		delay = (uint64_t)outq * sp->byte_ns;
+		stats_inc(tty_delay_samples);
+		__atomic_fetch_add(&stats.tty_delay_sum_ns, delay, __ATOMIC_RELAXED);
+		stats_max(&stats.tty_delay_max_ns, delay);
+
+		if (outq > BUFFSIZE)
+			sp->next_ns = now + (uint64_t)(outq - BUFFSIZE) * sp->byte_ns;
+	}
+
+	if (now < sp->next_ns) {
+		if (!sp->timer_armed) {
+			reactor_arm_timer(&sp->timer_h, sp->next_ns);
+			sp->timer_armed = 1;
+		}
+		return 0;
+	}
+
+	return 1 + (now - sp->next_ns) / sp->frame_ns;
+}
+
+/* n frames have been started on the link */
+void serial_paced(struct serialport *sp, unsigned int n)
+{
+	sp->next_ns += n * sp->frame_ns;
+}
+
+void serial_timer_event(struct handler *h, unsigned int events)
+{
+	struct serialport *sp = h->arg;
+
+	reactor_timer_ack(h);
+	sp->timer_armed = 0;
+	sp->flush(sp);
+}
+
+/* frames waiting in the coalescer or the client queues */
+unsigned int serial_backlog(struct serialport *sp)
+{
+	if (sp->co != NULL)
+		return coalesce_pending(sp->co);
+	if (sp->drr != NULL)
+		return drr_pending(sp->drr);
+	if (sp->ct != NULL)
+		return chantable_pending(sp->ct);
+	return 0;
+}
+
+/* move dirty channels or the next frames in round robin order into the
+ * empty queue, or continue a refresh round once they are all out
+ * returns the number of frames queued */
+unsigned int serial_refill(struct serialport *sp)
+{
+	unsigned int n = 0;
+	unsigned int burst = COALESCE_BURST;
+	uint64_t now, stamp;
+
+	if (sp->tail != sp->head)
+		return 0;
+
+	/* paced, one frame at a time keeps the rest supersedable and lets a
+	 * client that shows up now have the next slot */
+	if (sp->frame_ns != 0)
+		burst = 1;
+
+	if (sp->co != NULL) {
+		while (n < burst && coalesce_get(sp->co, sp->queue[sp->tail & sp->mask], &stamp)) {
+			if (sp->stamps != NULL)
+				sp->stamps[sp->tail & sp->mask] = stamp;
+			sp->tail++;
+			n++;
+		}
+	} else if (sp->drr != NULL) {
+		now = reactor_now();
+		while (n < burst && drr_get(sp->drr, sp->queue[sp->tail & sp->mask], now)) {
+			if (sp->stamps != NULL)
+				sp->stamps[sp->tail & sp->mask] = sp->drr->got_ns;
+			sp->tail++;
+			n++;
+		}
+	} else if (sp->ct != NULL) {
+		unsigned char *frame = sp->queue[sp->tail & sp->mask];
+
+		while (n < burst && chantable_get(sp->ct, frame, &stamp)) {
+			if (sp->stamps != NULL)
+				sp->stamps[sp->tail & sp->mask] = stamp;
+			sp->tail++;
+			n++;
+			frame = sp->queue[sp->tail & sp->mask];
+		}
+	}
+
+	if (n == 0 && serial_backlog(sp) == 0)
+		n = serial_refresh_next(sp);
+	return n;
+}
+
+/* a frame is complete in the tty, it is on the wire once the bytes
+ * ahead of it and its own are out */
+void serial_record_drain(struct serialport *sp)
+{
+	int outq;
+
+	if (ioctl(sp->fd, TIOCOUTQ, &outq) == 0)
+		hist_record(&latency[LAT_DRAIN], (uint64_t)outq * sp->byte_ns);
+}
+
+/* write as much of the queue as the port takes without blocking */
+void serial_flush(struct serialport *sp)
+{
+	/* hung up, the queue waits for serial_retry_event() */
+	if (sp->fd < 0)
+		return;
+
+	while (42) {
+		unsigned char *frame;
+		int n;
+
+		if (sp->tail == sp->head && serial_backlog(sp) == 0 && !serial_refreshing(sp))
+			break;
+
+		/* a new frame has to wait for its slot, until then it stays in
+		 * the coalescer where newer values can still replace it */
+		if (sp->offset == 0 && serial_pace(sp) == 0)
+			break;
+
+		if (sp->tail == sp->head && serial_refill(sp) == 0)
+			break;
+
+		/* a repeated value costs no link time and no slot */
+		serial_skip_redundant(sp);
+		if (sp->tail == sp->head)
+			continue;
+
+		frame = serial_frame(sp, 0);
+		n = write(sp->fd, frame + sp->offset, BUFFSIZE - sp->offset);
+		if (n > 0 && sp->offset == 0)
+			serial_paced(sp, 1);
+		if (n > 0 && sp->offset == 0 && sp->stamps != NULL)
+			latency_record(LAT_QUEUE, sp->stamps[sp->head & sp->mask], reactor_now());
+
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				break;
+			stats_inc(write_errors);
+			msg_Err("write() failed!");
+			/* drop the frame, the next one might get through */
+			serial_forget(sp, frame);
+			serial_advance(sp);
+			continue;
+		}
+
+		sp->offset += n;
+		if (sp->offset < BUFFSIZE) {
+			/* resume with the rest of the frame once we get EPOLLOUT */
+			stats_inc(partial_writes);
+		} else {
+			stats_inc(written);
+			sp->written++;
+			msg_Dbg("Value(s) written to serial port");
+			if (sp->stamps != NULL)
+				serial_record_drain(sp);
+			serial_sent(sp, frame);
+			serial_advance(sp);
+		}
+	}
+
+	/* only ask for EPOLLOUT while there is something left to write
+	 * and we aren't just waiting for the next slot */
+	if (sp->fd >= 0)
+		reactor_mod(&sp->h, (sp->tail != sp->head && !sp->timer_armed) ? EPOLLOUT : 0);
+}
+
+/* queue a frame from client without writing it yet, stamp is when it
+ * was validated (0 without --latency) */
+void serial_queue_frame(struct serialport *sp, const unsigned char *buffer, in_addr_t client,
+						uint64_t stamp)
+{
+	/* the controller has this value and nothing else is on its way, the
+	 * common case gets away without using a slot; queued repeats are
+	 * caught by serial_skip_redundant() */
+	if (sp->shadow != NULL && sp->tail == sp->head && serial_backlog(sp) == 0
+		&& sp->shadow[frame_channel(buffer) - sp->lo] == frame_value(buffer)) {
+		stats_inc(suppressed);
+		return;
+	}
+
+	if (sp->co != NULL) {
+		if (coalesce_put(sp->co, buffer, stamp)) {
+			stats_inc(superseded);
+		}
+		return;
+	}
+
+	if (sp->drr != NULL) {
+		switch (drr_put(sp->drr, buffer, client, stamp != 0 ? stamp : reactor_now())) {
+			case 0:
+				stats_inc(dropped);
+				msg_Dbg("client queue full, frame dropped");
+				return;
+			case 2:
+				stats_inc(dropped);
+				msg_Dbg("client queue full, oldest frame dropped");
+				break;
+		}
+		return;
+	}
+
+	/* tombstones behind a partly written or pinned head still hold
+	 * their slots, a full ring takes nothing whatever the policy */
+	if (sp->tail - sp->head > sp->mask) {
+		stats_inc(dropped);
+		msg_Dbg("serial queue full, frame dropped");
+		return;
+	}
+
+	if (serial_queued(sp) >= sp->highwater) {
+		stats_inc(dropped);
+		if (sp->drop_policy != DROP_OLDEST || !serial_drop_oldest(sp)) {
+			msg_Dbg("serial queue full, frame dropped");
+			return;
+		}
+		msg_Dbg("serial queue full, oldest frame dropped");
+	}
+
+	memcpy(sp->queue[sp->tail & sp->mask], buffer, BUFFSIZE);
+	if (sp->stamps != NULL)
+		sp->stamps[sp->tail & sp->mask] = stamp;
+	sp->tail++;
+}
+
+/* queue a frame for the serial port */
+void serial_write(struct serialport *sp, const unsigned char *buffer, in_addr_t client,
+				  uint64_t stamp)
+{
+	serial_queue_frame(sp, buffer, client, stamp);
+	sp->flush(sp);
+}
+
+void serial_event(struct handler *h, unsigned int events)
+{
+	struct serialport *sp = h->arg;
+
+	if (events & (EPOLLERR | EPOLLHUP)) {
+		/* a USB adapter that went away, or a pty whose other side
+		 * closed: epoll keeps reporting it, so close the port and
+		 * reopen it until it's back. The queue stays, a partly
+		 * written frame starts over and the controller resyncs on
+		 * its start byte; what it has is unknown now. */
+		msg_Err("serial port %s hung up, reopening", sp->path);
+		reactor_del(h);
+		close(sp->fd);
+		sp->fd = -1;
+		sp->offset = 0;
+		if (sp->shadow != NULL)
+			memset(sp->shadow, 0xff, (sp->hi - sp->lo + 1) * sizeof(unsigned short));
+		reactor_arm_timer(&sp->retry_h, reactor_now() + SERIAL_RETRY_MS * 1000000ULL);
+		return;
+	}
+	sp->flush(sp);
+}
+
+void serial_retry_event(struct handler *h, unsigned int events)
+{
+	struct serialport *sp = h->arg;
+	const char *error;
+	int fd;
+
+	reactor_timer_ack(h);
+
+	fd = open(sp->path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (fd >= 0 && (error = serial_configure(fd, sp->baud)) != NULL) {
+		msg_Dbg("%s: %s", sp->path, error);
+		close(fd);
+		fd = -1;
+	}
+	if (fd < 0) {
+		reactor_arm_timer(h, reactor_now() + SERIAL_RETRY_MS * 1000000ULL);
+		return;
+	}
+
+	msg_Info("serial port %s reopened", sp->path);
+	sp->fd = fd;
+	reactor_add(&sp->h, fd, 0, serial_event, sp);
+	sp->flush(sp);
+}
+
+/* open the port
+ * pace is the share of the wire capacity to use in percent, 0 = unpaced */
+void serial_open(struct serialport *sp, int pBaud, int pace)
+{
+	sp->fd = open_port(sp->path, pBaud);
+	sp->flush = serial_flush;
+
+	sp->baud = pBaud;
+	sp->byte_ns = BITS_PER_BYTE * 1000000000ULL / pBaud;
+	stats.link_capacity += (double)pBaud / (BITS_PER_BYTE * BUFFSIZE);
+
+	if (pace > 0) {
+		sp->frame_ns = sp->byte_ns * BUFFSIZE * 100 / pace;
+		sp->next_ns = reactor_now();
+		msg_Dbg("pacing %s at %i%% of %.1f frames/s", sp->path, pace,
+				(double)pBaud / (BITS_PER_BYTE * BUFFSIZE));
+	}
+}
+
+/* remember what the controller got, so repeated values cost no link time
+ * refresh_s > 0 sends every known value again that often, so a
+ * controller that lost bytes converges without the desk's help */
+void serial_init_shadow(struct serialport *sp, int refresh_s)
+{
+	unsigned int size = sp->hi - sp->lo + 1;
+
+	sp->shadow = malloc(size * sizeof(unsigned short));
+	if (sp->shadow == NULL) {
+		die("Unable to allocate shadow table");
+	}
+	memset(sp->shadow, 0xff, size * sizeof(unsigned short));
+	sp->refresh_ms = refresh_s * 1000L;
+	sp->refresh_pos = size;
+}
+
+void serial_refresh_event(struct handler *h, unsigned int events)
+{
+	struct serialport *sp = h->arg;
+
+	/* a round still running just starts over, it is paced like
+	 * everything else and only uses slots nothing else wants */
+	if (reactor_timer_ack(h) > 0) {
+		msg_Dbg("refreshing %s", sp->path);
+		sp->refresh_pos = 0;
+		sp->flush(sp);
+	}
+}
+
+/* receive workers stored something while we had nothing to do */
+void serial_ct_event(struct handler *h, unsigned int events)
+{
+	struct serialport *sp = h->arg;
+	uint64_t count;
+
+	if (read(h->fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		msg_Dbg("channel table eventfd read failed");
+	sp->flush(sp);
+}
+
+/* hook an open port into the calling thread's event loop */
+void serial_attach(struct serialport *sp)
+{
+	reactor_add(&sp->h, sp->fd, 0, serial_event, sp);
+	reactor_add_oneshot(&sp->retry_h, serial_retry_event, sp);
+	if (sp->frame_ns != 0)
+		reactor_add_oneshot(&sp->timer_h, serial_timer_event, sp);
+	if (sp->ct != NULL)
+		reactor_add(&sp->ct_h, sp->ct->efd, EPOLLIN, serial_ct_event, sp);
+	if (sp->shadow != NULL && sp->refresh_ms > 0)
+		reactor_add_timer(&sp->refresh_h, sp->refresh_ms, serial_refresh_event, sp);
+}
+
+void serial_start(struct serialport *sp, int pBaud, int pace)
+{
+	serial_open(sp, pBaud, pace);
+	serial_attach(sp);
+}
+
+/* receive side: queue a frame, or hand it to the port's writer thread */
+void serial_post(struct serialport *sp, const unsigned char *buffer, in_addr_t client,
+				 uint64_t stamp)
+{
+	uint64_t one = 1;
+
+	if (sp->ct != NULL) {
+		if (chantable_put(sp->ct, buffer, stamp))
+			stats_inc(superseded);
+		return;
+	}
+
+	if (!sp->threaded) {
+		serial_write(sp, buffer, client, stamp);
+		return;
+	}
+
+	if (!spsc_push(&sp->ring, buffer, client, stamp)) {
+		stats_inc(dropped);
+		msg_Dbg("writer thread for %s behind, frame dropped", sp->path);
+		return;
+	}
+
+	/* the frame must be visible before we look at sleeping, the thread
+	 * does the same the other way round */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&sp->sleeping, __ATOMIC_RELAXED)
+		&& __atomic_exchange_n(&sp->sleeping, 0, __ATOMIC_ACQ_REL)) {
+		if (write(sp->wake_fd, &one, sizeof(one)) < 0)
+			msg_Dbg("Unable to wake writer thread");
+	}
+}
+
+void serial_wake_event(struct handler *h, unsigned int events)
+{
+	uint64_t count;
+
+	if (read(h->fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		msg_Dbg("writer thread eventfd read failed");
+}
+
+/* writer thread: drain the ring into the queue, write, sleep in our own
+ * event loop while there is nothing to take */
+void *serial_thread(void *arg)
+{
+	struct serialport *sp = arg;
+	unsigned char frame[BUFFSIZE];
+	in_addr_t client;
+	uint64_t stamp;
+	int n;
+
+	reactor_init();
+	serial_attach(sp);
+	reactor_add(&sp->wake_h, sp->wake_fd, EPOLLIN, serial_wake_event, sp);
+
+	while (!__atomic_load_n(&sp->stop, __ATOMIC_ACQUIRE)) {
+		for (n = 0; n < SERIAL_THREAD_BATCH && spsc_pop(&sp->ring, frame, &client, &stamp); n++) {
+			serial_queue_frame(sp, frame, client, stamp);
+		}
+		if (n > 0) {
+			sp->flush(sp);
+			/* give the tty and the timer a chance between batches */
+			reactor_poll(0);
+			continue;
+		}
+
+		__atomic_store_n(&sp->sleeping, 1, __ATOMIC_SEQ_CST);
+		if (!spsc_empty(&sp->ring)) {
+			__atomic_store_n(&sp->sleeping, 0, __ATOMIC_RELAXED);
+			continue;
+		}
+		reactor_poll(-1);
+	}
+
+	close(reactor_fd);
+	return NULL;
+}
+
+/* move the port to its own thread, cpu < 0 = don't pin it */
+void serial_start_thread(struct serialport *sp, unsigned int ringlen, int cpu)
+{
+	spsc_init(&sp->ring, ringlen);
+	sp->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (sp->wake_fd < 0) {
+		die("Failed to create eventfd");
+	}
+	sp->threaded = 1;
+
+	if (pthread_create(&sp->thread, NULL, serial_thread, sp) != 0) {
+		die("Unable to start writer thread");
+	}
+
+	if (cpu >= 0) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (pthread_setaffinity_np(sp->thread, sizeof(set), &set) != 0) {
+			msg_Err("Unable to pin writer thread for %s to CPU %i", sp->path, cpu);
+		} else {
+			msg_Dbg("writer thread for %s pinned to CPU %i", sp->path, cpu);
+		}
+	}
+}
+
+/* ask the writer thread to finish and wait for it */
+void serial_stop_thread(struct serialport *sp)
+{
+	uint64_t one = 1;
+
+	if (!sp->threaded)
+		return;
+
+	__atomic_store_n(&sp->stop, 1, __ATOMIC_RELEASE);
+	if (write(sp->wake_fd, &one, sizeof(one)) < 0)
+		msg_Dbg("Unable to wake writer thread");
+	pthread_join(sp->thread, NULL);
+	close(sp->wake_fd);
+}
+
+/* per port counters, called from stats_print() */
+void serial_print_stats(void)
+{
+	int i;
+
+	for (i = 0; i < nports; i++) {
+		struct serialport *sp = &ports[i];
+
+		if (nports > 1) {
+			msg_Info("stats: %s (channels %u-%u): %lu written, %u queued, %u pending",
+					 sp->path, sp->lo, sp->hi, sp->written, serial_queued(sp),
+					 serial_backlog(sp));
+		}
+		if (sp->drr != NULL)
+			drr_print(sp->drr, sp->path);
+	}
+}
@@ -0,0 +1,248 @@
+/*****************************************************************************
+ * shmingest.h: server side of the --shm frame ring
+ *****************************************************************************
+ * Copyright (C) 2011 Kai Hermann
+ *
+ * Authors: Kai Hermann <kai.uwe.hermann at gmail dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/* Creates the segment described in shmring.h and drains it from the event
+ * loop. Frames are gathered into a buffer and handed to handle_datagram()
+ * like a datagram from 127.0.0.1, so they get the same checkbuffer(),
+ * --rate and routing as everything else. We drain on the eventfd a
+ * producer writes when we said we are waiting; a doorbell thread writes
+ * it for producers that ring the futex instead. --shm-poll adds a timer
+ * on top, it isn't needed for either. */
+
+#include "shmring.h"
+
+#define SHM_BATCH 245	/* frames per handle_datagram(), one MTU worth */
+
+void handle_datagram(unsigned char *buffer, int received,
+					 struct sockaddr_in *client, struct allowlist *allow, uint64_t rxstamp);
+
+struct shmingest {
+	struct shmring *ring;
+	size_t bytes;
+	const char *name;
+	uint32_t mask;
+	uint32_t cached_tail;
+	int efd;
+	pthread_t bell_thread;
+	int bell_stop;
+	struct handler h;
+	struct handler poll_h;
+	struct sockaddr_in client;
+	unsigned char buffer[SHM_BATCH * BUFFSIZE];
+
+	/* since the last stats_print() */
+	unsigned long frames;
+	unsigned long wakeups;
+	unsigned long stamped;
+	uint64_t latency_sum_ns;
+	uint64_t latency_max_ns;
+};
+
+struct shmingest shmingest;
+
+/* take up to the ring's size of frames, returns how many */
+unsigned int shmingest_drain(struct shmingest *s)
+{
+	struct shmring *ring = s->ring;
+	uint32_t head = ring->head;
+	unsigned int n = 0, total = 0;
+	uint64_t now = reactor_now(), first = 0;
+
+	while (total <= s->mask) {
+		struct shmring_slot *slot;
+
+		if (head == s->cached_tail) {
+			s->cached_tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+			if (head == s->cached_tail)
+				break;
+		}
+
+		slot = &ring->slots[head & s->mask];
+		memcpy(s->buffer + n * BUFFSIZE, slot->frame, BUFFSIZE);
+		if (n == 0)
+			first = slot->stamp;	/* the batch counts as received then */
+		if (slot->stamp != 0 && slot->stamp <= now) {
+			s->stamped++;
+			s->latency_sum_ns += now - slot->stamp;
+			if (now - slot->stamp > s->latency_max_ns)
+				s->latency_max_ns = now - slot->stamp;
+		}
+		head++;
+		n++;
+		total++;
+
+		if (n == SHM_BATCH) {
+			/* the slots are copied, give them back before the work */
+			__atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+			handle_datagram(s->buffer, n * BUFFSIZE, &s->client, NULL, first);
+			n = 0;
+		}
+	}
+
+	__atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+	if (n > 0)
+		handle_datagram(s->buffer, n * BUFFSIZE, &s->client, NULL, first);
+	s->frames += total;
+	return total;
+}
+
+/* tell the producer to wake us, unless there is more to do already */
+void shmingest_sleep(struct shmingest *s)
+{
+	uint64_t one = 1;
+
+	__atomic_store_n(&s->ring->waiting, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&s->ring->tail, __ATOMIC_SEQ_CST) != s->ring->head) {
+		/* come back after the other fds had their turn */
+		__atomic_store_n(&s->ring->waiting, 0, __ATOMIC_RELAXED);
+		if (write(s->efd, &one, sizeof(one)) < 0)
+			msg_Dbg("Unable to requeue shm ring");
+	}
+}
+
+void shmingest_event(struct handler *h, unsigned int events)
+{
+	struct shmingest *s = h->arg;
+	uint64_t count;
+
+	if (read(h->fd, &count, sizeof(count)) > 0)
+		s->wakeups++;
+	shmingest_drain(s);
+	shmingest_sleep(s);
+}
+
+void shmingest_poll_event(struct handler *h, unsigned int events)
+{
+	struct shmingest *s = h->arg;
+
+	if (reactor_timer_ack(h) > 0 && shmingest_drain(s) > 0)
+		shmingest_sleep(s);
+}
+
+/* doorbell thread: turn the futex a producer rings into the eventfd the
+ * loop waits on */
+void *shmingest_bell_thread(void *arg)
+{
+	struct shmingest *s = arg;
+	uint64_t one = 1;
+
+	while (!__atomic_load_n(&s->bell_stop, __ATOMIC_ACQUIRE)) {
+		if (__atomic_exchange_n(&s->ring->bell, 0, __ATOMIC_ACQ_REL)) {
+			if (write(s->efd, &one, sizeof(one)) < 0)
+				msg_Dbg("Unable to wake the loop for the shm ring");
+			continue;
+		}
+		shmring_futex(&s->ring->bell, FUTEX_WAIT, 0);
+	}
+	return NULL;
+}
+
+/* create the segment name with room for size frames (a power of 2) */
+void shmingest_start(struct shmingest *s, const char *name, unsigned int size, int poll_ms)
+{
+	struct shmring *ring;
+	sigset_t all, old;
+	int fd;
+
+	s->name = name;
+	s->bytes = shmring_bytes(size);
+
+	/* a previous run may have left its segment behind */
+	shm_unlink(name);
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0660);
+	if (fd < 0) {
+		die("Failed to create shared memory segment");
+	}
+	if (fchmod(fd, 0660) < 0 || ftruncate(fd, s->bytes) < 0) {
+		die("Failed to size shared memory segment");
+	}
+	ring = mmap(NULL, s->bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ring == MAP_FAILED) {
+		die("Failed to map shared memory segment");
+	}
+
+	s->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (s->efd < 0) {
+		die("Failed to create eventfd");
+	}
+
+	s->ring = ring;
+	s->mask = size - 1;
+	s->cached_tail = 0;
+	s->bell_stop = 0;
+	s->client.sin_family = AF_INET;
+	s->client.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	ring->version = SHMRING_VERSION;
+	ring->size = size;
+	ring->server_pid = getpid();
+	ring->server_efd = s->efd;
+	ring->waiting = 1;
+	__atomic_store_n(&ring->magic, SHMRING_MAGIC, __ATOMIC_RELEASE);
+
+	/* signals belong to the event loop */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	if (pthread_create(&s->bell_thread, NULL, shmingest_bell_thread, s) != 0) {
+		die("Unable to start shm doorbell thread");
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	reactor_add(&s->h, s->efd, EPOLLIN, shmingest_event, s);
+	if (poll_ms > 0)
+		reactor_add_timer(&s->poll_h, poll_ms, shmingest_poll_event, s);
+
+	msg_Info("Receiving frames from shared memory %s (%u frames)", name, size);
+}
+
+void shmingest_stop(struct shmingest *s)
+{
+	if (s->ring == NULL)
+		return;
+
+	__atomic_store_n(&s->bell_stop, 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&s->ring->bell, 1, __ATOMIC_RELEASE);
+	shmring_futex(&s->ring->bell, FUTEX_WAKE, 1);
+	pthread_join(s->bell_thread, NULL);
+
+	munmap(s->ring, s->bytes);
+	shm_unlink(s->name);
+	close(s->efd);
+	s->ring = NULL;
+}
+
+/* ring throughput and queueing delay, compare with the UDP datagrams/s */
+void shmingest_print_stats(void)
+{
+	struct shmingest *s = &shmingest;
+
+	if (s->ring == NULL)
+		return;
+
+	msg_Info("stats: shm: %lu frames, %lu wakeups, latency avg %.2f us, max %.2f us",
+			 s->frames, s->wakeups,
+			 s->stamped > 0 ? s->latency_sum_ns / 1e3 / s->stamped : 0.0,
+			 s->latency_max_ns / 1e3);
+	s->frames = s->wakeups = s->stamped = 0;
+	s->latency_sum_ns = s->latency_max_ns = 0;
+}
@@ -0,0 +1,204 @@
+/*****************************************************************************
+ * shmring.h: shared memory frame ring for local producers
+ *****************************************************************************
+ * Copyright (C) 2011 Kai Hermann
+ *
+ * Authors: Kai Hermann <kai.uwe.hermann at gmail dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/* Layout of the --shm segment and the producer side of it. A producer on
+ * the same machine includes this file, calls shmring_attach() with the
+ * name given to --shm and then shmring_put() for every frame: a store into
+ * the mapping and no system call unless the server went to sleep.
+ *
+ * The ring has exactly one producer and one consumer (the server). Each
+ * side owns its index and only reads the other one when its cached copy
+ * says the ring is full or empty, like spsc.h. Before the server waits
+ * it sets waiting and looks at the ring once more; a producer that finds
+ * waiting set after publishing a frame wakes the server. With ptrace
+ * rights on the server it gets the server's eventfd with pidfd_getfd()
+ * and writes it. Without them it rings bell, a futex in the segment that
+ * a server thread waits on and forwards to the eventfd; futexes in
+ * shared memory need no rights beyond the mapping. Either way the
+ * producer makes one system call per wakeup and none otherwise. */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define SHMRING_MAGIC 0x52574945	/* "EIWR" */
+#define SHMRING_VERSION 2
+#define SHMRING_FRAME 6
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+#ifndef SYS_pidfd_getfd
+#define SYS_pidfd_getfd 438
+#endif
+
+struct shmring_slot {
+	uint64_t stamp;		/* CLOCK_MONOTONIC ns when queued, 0 = unknown */
+	unsigned char frame[SHMRING_FRAME];
+	unsigned char pad[2];
+};
+
+struct shmring {
+	/* set up by the server, magic last */
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;		/* slots, a power of 2 */
+	int32_t server_pid;
+	int32_t server_efd;	/* eventfd number in the server process */
+	int32_t producer_pid;	/* 0 = nobody attached */
+
+	/* written by the producer */
+	uint32_t tail __attribute__((aligned(64)));
+
+	/* written by the server */
+	uint32_t head __attribute__((aligned(64)));
+	uint32_t waiting;	/* server sleeps until the eventfd fires */
+
+	/* set by a producer without the eventfd, cleared by the server */
+	uint32_t bell __attribute__((aligned(64)));
+
+	struct shmring_slot slots[] __attribute__((aligned(64)));
+};
+
+/* bytes of a segment with size slots */
+size_t shmring_bytes(uint32_t size)
+{
+	return sizeof(struct shmring) + size * sizeof(struct shmring_slot);
+}
+
+/* producer state, private to the producing process */
+struct shmring_producer {
+	struct shmring *ring;
+	size_t bytes;
+	uint32_t mask;
+	uint32_t tail;
+	uint32_t cached_head;
+	int efd;		/* our copy of the server's eventfd, -1 = none */
+};
+
+/* map the segment and claim the producer side,
+ * returns 0 or -1 with errno set (EBUSY: another producer is attached) */
+int shmring_attach(struct shmring_producer *p, const char *name)
+{
+	struct stat st;
+	int32_t owner = 0;
+	int fd, pidfd;
+
+	fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct shmring)) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	p->bytes = st.st_size;
+	p->ring = mmap(NULL, p->bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p->ring == MAP_FAILED)
+		return -1;
+
+	if (__atomic_load_n(&p->ring->magic, __ATOMIC_ACQUIRE) != SHMRING_MAGIC
+		|| p->ring->version != SHMRING_VERSION
+		|| shmring_bytes(p->ring->size) > p->bytes) {
+		munmap(p->ring, p->bytes);
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* take over from a producer that died without detaching */
+	if (!__atomic_compare_exchange_n(&p->ring->producer_pid, &owner, getpid(), 0,
+									 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		if (kill(owner, 0) == 0 || errno != ESRCH
+			|| !__atomic_compare_exchange_n(&p->ring->producer_pid, &owner, getpid(), 0,
+											__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			munmap(p->ring, p->bytes);
+			errno = EBUSY;
+			return -1;
+		}
+	}
+
+	p->mask = p->ring->size - 1;
+	p->tail = __atomic_load_n(&p->ring->tail, __ATOMIC_RELAXED);
+	p->cached_head = __atomic_load_n(&p->ring->head, __ATOMIC_ACQUIRE);
+
+	p->efd = -1;
+	pidfd = syscall(SYS_pidfd_open, p->ring->server_pid, 0);
+	if (pidfd >= 0) {
+		p->efd = syscall(SYS_pidfd_getfd, pidfd, p->ring->server_efd, 0);
+		close(pidfd);
+	}
+	return 0;
+}
+
+void shmring_detach(struct shmring_producer *p)
+{
+	__atomic_store_n(&p->ring->producer_pid, 0, __ATOMIC_RELEASE);
+	munmap(p->ring, p->bytes);
+	if (p->efd >= 0)
+		close(p->efd);
+}
+
+/* FUTEX_WAIT/FUTEX_WAKE on a word of the segment, shared between
+ * processes, so no FUTEX_PRIVATE_FLAG */
+long shmring_futex(uint32_t *word, int op, uint32_t val)
+{
+	return syscall(SYS_futex, word, op, val, NULL, NULL, 0);
+}
+
+/* queue a 6 byte frame, returns 0 if the ring is full */
+int shmring_put(struct shmring_producer *p, const unsigned char *frame)
+{
+	struct shmring_slot *slot;
+	struct timespec ts;
+	uint64_t one = 1;
+
+	if (p->tail - p->cached_head > p->mask) {
+		p->cached_head = __atomic_load_n(&p->ring->head, __ATOMIC_ACQUIRE);
+		if (p->tail - p->cached_head > p->mask)
+			return 0;
+	}
+
+	slot = &p->ring->slots[p->tail & p->mask];
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	slot->stamp = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	memcpy(slot->frame, frame, SHMRING_FRAME);
+	p->tail++;
+	__atomic_store_n(&p->ring->tail, p->tail, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&p->ring->waiting, __ATOMIC_SEQ_CST)) {
+		__atomic_store_n(&p->ring->waiting, 0, __ATOMIC_RELAXED);
+		if (p->efd >= 0 && write(p->efd, &one, sizeof(one)) == sizeof(one))
+			return 1;
+		__atomic_store_n(&p->ring->bell, 1, __ATOMIC_RELEASE);
+		shmring_futex(&p->ring->bell, FUTEX_WAKE, 1);
+	}
+	return 1;
+}
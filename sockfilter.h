@@ -0,0 +1,151 @@
+/*****************************************************************************
+ * sockfilter.h: drop junk datagrams in the kernel
+ *****************************************************************************
+ * Copyright (C) 2011 Kai Hermann
+ *
+ * Authors: Kai Hermann <kai.uwe.hermann at gmail dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/* A classic BPF program on the UDP socket throws away datagrams that
+ * handle_datagram() would reject anyway, before they wake us up: wrong
+ * client, length not a multiple of BUFFSIZE, first byte not 255. It is
+ * only a pre-filter, every datagram that gets through is checked again.
+ *
+ * For a UDP socket the program sees the packet from the UDP header on,
+ * the IP header is reached through SKF_NET_OFF. */
+
+#include <linux/filter.h>
+
+#define UDP_HEADER 8
+
+struct sockfilter {
+	struct sock_filter *insns;
+	unsigned int count, max;
+};
+
+void sockfilter_emit(struct sockfilter *f, unsigned short code, unsigned char jt,
+					 unsigned char jf, unsigned int k)
+{
+	if (f->count == f->max) {
+		f->max = f->max ? f->max * 2 : 64;
+		f->insns = realloc(f->insns, f->max * sizeof(struct sock_filter));
+		if (f->insns == NULL) {
+			die("Unable to allocate socket filter");
+		}
+	}
+	f->insns[f->count].code = code;
+	f->insns[f->count].jt = jt;
+	f->insns[f->count].jf = jf;
+	f->insns[f->count].k = k;
+	f->count++;
+}
+
+/* accept the source address if it matches addr under mask; a host
+ * compares A as loaded before the first host, a prefix loads it again.
+ * The jump to the frame checks is patched in later, jt/jf only reach
+ * 255 instructions. */
+void sockfilter_match(struct sockfilter *f, uint32_t addr, uint32_t mask, unsigned int *jumps,
+					  unsigned int *njumps)
+{
+	if (mask != 0xffffffffU) {
+		sockfilter_emit(f, BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_NET_OFF + 12);
+		sockfilter_emit(f, BPF_ALU | BPF_AND | BPF_K, 0, 0, mask);
+	}
+	sockfilter_emit(f, BPF_JMP | BPF_JEQ | BPF_K, 0, 1, addr);
+	jumps[(*njumps)++] = f->count;
+	sockfilter_emit(f, BPF_JMP | BPF_JA, 0, 0, 0);
+}
+
+/* walk the trie, one match per prefix */
+void sockfilter_prefixes(struct sockfilter *f, struct allowlist *a, unsigned int node,
+						 uint32_t addr, int len, unsigned int *jumps, unsigned int *njumps)
+{
+	int bit;
+
+	if (a->nodes[node].match) {
+		sockfilter_match(f, addr, len ? 0xffffffffU << (32 - len) : 0, jumps, njumps);
+		return;	/* anything below is covered */
+	}
+	for (bit = 0; bit < 2; bit++) {
+		if (a->nodes[node].child[bit] != 0)
+			sockfilter_prefixes(f, a, a->nodes[node].child[bit],
+								addr | (uint32_t)bit << (31 - len), len + 1, jumps, njumps);
+	}
+}
+
+/* build and attach the program, allow may be NULL
+ * returns -1 if the kernel doesn't take it, we then filter in userspace only */
+int sockfilter_attach(int sock, struct allowlist *allow)
+{
+	struct sockfilter f = { NULL, 0, 0 };
+	struct sock_fprog prog;
+	unsigned int *jumps = NULL, njumps = 0, i;
+
+	if (allow != NULL && 2 * allow->nhosts + 4 * allow->nprefixes + 16 > BPF_MAXINSNS) {
+		msg_Info("too many clients for the socket filter, checking them in userspace");
+		allow = NULL;
+	}
+
+	if (allow != NULL) {
+		jumps = calloc(allow->nhosts + allow->nprefixes + 1, sizeof(unsigned int));
+		if (jumps == NULL) {
+			die("Unable to allocate socket filter");
+		}
+		/* source address of the IP header */
+		sockfilter_emit(&f, BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_NET_OFF + 12);
+		if (allow->zero)
+			sockfilter_match(&f, 0, 0xffffffffU, jumps, &njumps);
+		for (i = 0; i <= allow->mask; i++) {
+			if (allow->hosts[i] != 0)
+				sockfilter_match(&f, allow->hosts[i], 0xffffffffU, jumps, &njumps);
+		}
+		if (allow->nprefixes > 0)
+			sockfilter_prefixes(&f, allow, 0, 0, 0, jumps, &njumps);
+		sockfilter_emit(&f, BPF_RET | BPF_K, 0, 0, 0);
+
+		/* every match continues with the frame checks */
+		for (i = 0; i < njumps; i++) {
+			f.insns[jumps[i]].k = f.count - jumps[i] - 1;
+		}
+		free(jumps);
+	}
+
+	/* payload length a multiple of BUFFSIZE */
+	sockfilter_emit(&f, BPF_LD | BPF_W | BPF_LEN, 0, 0, 0);
+	sockfilter_emit(&f, BPF_ALU | BPF_SUB | BPF_K, 0, 0, UDP_HEADER);
+	sockfilter_emit(&f, BPF_ALU | BPF_MOD | BPF_K, 0, 0, BUFFSIZE);
+	sockfilter_emit(&f, BPF_JMP | BPF_JEQ | BPF_K, 1, 0, 0);
+	sockfilter_emit(&f, BPF_RET | BPF_K, 0, 0, 0);
+
+	/* start byte, an empty datagram fails the load and is dropped too */
+	sockfilter_emit(&f, BPF_LD | BPF_B | BPF_ABS, 0, 0, UDP_HEADER);
+	sockfilter_emit(&f, BPF_JMP | BPF_JEQ | BPF_K, 1, 0, 255);
+	sockfilter_emit(&f, BPF_RET | BPF_K, 0, 0, 0);
+	sockfilter_emit(&f, BPF_RET | BPF_K, 0, 0, 0xffffffffU);
+
+	prog.len = f.count;
+	prog.filter = f.insns;
+	if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+		msg_Err("Unable to attach socket filter: %s", strerror(errno));
+		free(f.insns);
+		return -1;
+	}
+
+	msg_Dbg("socket filter attached, %u instructions", f.count);
+	free(f.insns);
+	return 0;
+}
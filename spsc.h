@@ -0,0 +1,107 @@
+/*****************************************************************************
+ * spsc.h: single producer, single consumer frame ring
+ *****************************************************************************
+ * Copyright (C) 2011 Kai Hermann
+ *
+ * Authors: Kai Hermann <kai.uwe.hermann at gmail dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/* Hands validated frames from the receive loop to a writer thread without
+ * locks. Each side owns one index and keeps a cached copy of the other
+ * one, so it only touches the other side's cache line when its copy says
+ * the ring is full (producer) or empty (consumer). */
+
+#define CACHELINE 64
+
+/* a frame, the client it came from and when it was validated */
+struct spsc_slot {
+	uint64_t stamp;
+	in_addr_t client;
+	unsigned char frame[BUFFSIZE];
+};
+
+struct spsc {
+	/* written by the producer */
+	unsigned int tail __attribute__((aligned(CACHELINE)));
+	unsigned int cached_head;
+
+	/* written by the consumer */
+	unsigned int head __attribute__((aligned(CACHELINE)));
+	unsigned int cached_tail;
+
+	/* read-only after spsc_init() */
+	unsigned int mask __attribute__((aligned(CACHELINE)));
+	struct spsc_slot *slots;
+};
+
+/* allocate the ring, rounded up to a power of 2 */
+void spsc_init(struct spsc *q, unsigned int length)
+{
+	unsigned int size = 1;
+
+	while (size < length)
+		size <<= 1;
+
+	q->slots = calloc(size, sizeof(struct spsc_slot));
+	if (q->slots == NULL) {
+		die("Unable to allocate frame ring");
+	}
+	q->mask = size - 1;
+	q->head = q->tail = q->cached_head = q->cached_tail = 0;
+}
+
+/* producer: copy a frame in, returns 0 if the ring is full */
+int spsc_push(struct spsc *q, const unsigned char *frame, in_addr_t client, uint64_t stamp)
+{
+	unsigned int tail = q->tail;
+
+	if (tail - q->cached_head > q->mask) {
+		q->cached_head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+		if (tail - q->cached_head > q->mask)
+			return 0;
+	}
+
+	q->slots[tail & q->mask].client = client;
+	q->slots[tail & q->mask].stamp = stamp;
+	memcpy(q->slots[tail & q->mask].frame, frame, BUFFSIZE);
+	__atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* consumer: copy the oldest frame out, returns 0 if the ring is empty */
+int spsc_pop(struct spsc *q, unsigned char *frame, in_addr_t *client, uint64_t *stamp)
+{
+	unsigned int head = q->head;
+
+	if (head == q->cached_tail) {
+		q->cached_tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+		if (head == q->cached_tail)
+			return 0;
+	}
+
+	*client = q->slots[head & q->mask].client;
+	*stamp = q->slots[head & q->mask].stamp;
+	memcpy(frame, q->slots[head & q->mask].frame, BUFFSIZE);
+	__atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* consumer: anything left? */
+int spsc_empty(struct spsc *q)
+{
+	return q->head == __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST);
+}
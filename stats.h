@@ -0,0 +1,224 @@
+/*****************************************************************************
+ * stats.h: runtime counters
+ *****************************************************************************
+ * Copyright (C) 2011 Kai Hermann
+ *
+ * Authors: Kai Hermann <kai.uwe.hermann at gmail dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#include <time.h>
+#include <stddef.h>
+#include <sys/resource.h>
+
+struct stats {
+	unsigned long recv_calls;	/* receive syscalls that returned data */
+	unsigned long datagrams;	/* datagrams received */
+	unsigned long frames;		/* frames carried by those datagrams */
+	unsigned long rejected_client;	/* datagrams from a wrong client */
+	unsigned long rejected_frame;	/* frames failing checkbuffer(), partial or cut off frames */
+	unsigned long unrouted;		/* frames for a channel no serial port takes */
+	unsigned long rate_limited;	/* frames over their client's --rate */
+	unsigned long written;		/* frames written to the serial port */
+	unsigned long partial_writes;	/* write() took only part of a frame */
+	unsigned long dropped;		/* frames dropped at the high-water mark */
+	unsigned long superseded;	/* frames replaced by a newer value (--coalesce) */
+	unsigned long suppressed;	/* frames repeating the controller's value (--suppress) */
+	unsigned long write_errors;	/* failed write() calls */
+
+	/* serial link */
+	double link_capacity;		/* frames/s the baud rate can carry */
+	unsigned long tty_delay_samples;	/* TIOCOUTQ readings */
+	uint64_t tty_delay_sum_ns;	/* time the bytes in the tty still need */
+	uint64_t tty_delay_max_ns;
+};
+
+struct stats stats;
+
+/* counters the serial writer threads touch, see --writer-thread */
+#define stats_inc(field) __atomic_fetch_add(&stats.field, 1, __ATOMIC_RELAXED)
+
+void stats_max(uint64_t *max, uint64_t value)
+{
+	uint64_t old = __atomic_load_n(max, __ATOMIC_RELAXED);
+
+	while (value > old && !__atomic_compare_exchange_n(max, &old, value, 0,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/* receive counters of the calling thread. A receive worker counts into a
+ * struct of its own that only it writes, so a plain load and store are
+ * enough; readers add all of them up in stats_snapshot(). */
+__thread struct stats *rxstats = &stats;
+
+#define rxstats_inc(field) rxstats_add(field, 1)
+#define rxstats_add(field, n) \
+	__atomic_store_n(&rxstats->field, rxstats->field + (n), __ATOMIC_RELAXED)
+
+/* every struct stats someone counts into besides stats itself */
+#define STATS_MAXTHREADS 64
+struct stats *stats_threads[STATS_MAXTHREADS];
+int stats_nthreads = 0;
+
+/* the counters, for stats_snapshot() and the metrics endpoint */
+struct stats_field {
+	const char *name;
+	const char *help;
+	size_t offset;
+};
+
+#define STATS_FIELD(field, name, help) { name, help, offsetof(struct stats, field) }
+
+const struct stats_field stats_fields[] = {
+	STATS_FIELD(recv_calls, "receive_calls", "Receive system calls that returned data"),
+	STATS_FIELD(datagrams, "datagrams_received", "Datagrams (or stream reads) received"),
+	STATS_FIELD(frames, "frames_received", "Frames carried by those datagrams"),
+	STATS_FIELD(rejected_client, "rejected_clients", "Datagrams or connections refused by the client check"),
+	STATS_FIELD(rejected_frame, "frames_invalid", "Frames failing checkbuffer() and partial frames"),
+	STATS_FIELD(unrouted, "frames_unrouted", "Frames for a channel no serial port takes"),
+	STATS_FIELD(rate_limited, "frames_rate_limited", "Frames over their client's rate"),
+	STATS_FIELD(written, "frames_written", "Frames written to the serial ports"),
+	STATS_FIELD(partial_writes, "partial_writes", "Writes that took only part of a frame"),
+	STATS_FIELD(dropped, "frames_dropped", "Frames dropped at the high-water mark"),
+	STATS_FIELD(superseded, "frames_superseded", "Frames replaced by a newer value before they were sent"),
+	STATS_FIELD(suppressed, "frames_suppressed", "Frames repeating the value the controller has"),
+	STATS_FIELD(write_errors, "write_errors", "Failed serial write() calls"),
+};
+
+#define STATS_NFIELDS (sizeof(stats_fields) / sizeof(stats_fields[0]))
+
+/* count into s as well, before the thread using it starts */
+void stats_register(struct stats *s)
+{
+	if (stats_nthreads == STATS_MAXTHREADS) {
+		die("Too many counter sets");
+	}
+	stats_threads[stats_nthreads++] = s;
+}
+
+/* one counter summed over stats and every registered set */
+unsigned long stats_sum(const struct stats_field *f)
+{
+	unsigned long sum;
+	int i;
+
+	sum = __atomic_load_n((unsigned long *)((char *)&stats + f->offset), __ATOMIC_RELAXED);
+	for (i = 0; i < stats_nthreads; i++) {
+		sum += __atomic_load_n((unsigned long *)((char *)stats_threads[i] + f->offset),
+							   __ATOMIC_RELAXED);
+	}
+	return sum;
+}
+
+/* consistent enough copy of all counters for printing */
+void stats_snapshot(struct stats *s)
+{
+	unsigned int i;
+
+	memset(s, 0, sizeof(*s));
+	for (i = 0; i < STATS_NFIELDS; i++) {
+		*(unsigned long *)((char *)s + stats_fields[i].offset) = stats_sum(&stats_fields[i]);
+	}
+	s->link_capacity = stats.link_capacity;
+	s->tty_delay_samples = __atomic_load_n(&stats.tty_delay_samples, __ATOMIC_RELAXED);
+	s->tty_delay_sum_ns = __atomic_load_n(&stats.tty_delay_sum_ns, __ATOMIC_RELAXED);
+	s->tty_delay_max_ns = __atomic_load_n(&stats.tty_delay_max_ns, __ATOMIC_RELAXED);
+}
+
+void serial_print_stats(void);
+void worker_print_stats(void);
+void shmingest_print_stats(void);
+void tcp_print_stats(void);
+void latency_print_stats(void);
+
+/* print statistics every stats_interval seconds, 0 = never */
+int stats_interval = 0;
+
+/* state of the previous stats_print() for rates */
+struct timespec stats_last_time;
+double stats_last_cpu = 0.0;
+unsigned long stats_last_datagrams = 0;
+unsigned long stats_last_written = 0;
+
+/* user + system CPU seconds used by the process */
+double stats_cpu(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec
+		   + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+void stats_print(void)
+{
+	double avg_batch = 0.0;
+	double elapsed, cpu, rate = 0.0, cpu_per_frame = 0.0, written_rate = 0.0;
+	unsigned long frames;
+	struct timespec now;
+	struct stats s;
+
+	stats_snapshot(&s);
+
+	if (s.recv_calls > 0)
+		avg_batch = (double)s.datagrams / s.recv_calls;
+
+	/* frames/s and CPU per frame since the previous report */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	cpu = stats_cpu();
+	frames = s.datagrams - stats_last_datagrams;
+	elapsed = (now.tv_sec - stats_last_time.tv_sec)
+			  + (now.tv_nsec - stats_last_time.tv_nsec) / 1e9;
+	if (stats_last_time.tv_sec != 0 && elapsed > 0) {
+		rate = frames / elapsed;
+		written_rate = (s.written - stats_last_written) / elapsed;
+	}
+	if (frames > 0)
+		cpu_per_frame = (cpu - stats_last_cpu) * 1e6 / frames;
+
+	stats_last_time = now;
+	stats_last_cpu = cpu;
+	stats_last_datagrams = s.datagrams;
+	stats_last_written = s.written;
+
+	msg_Info("stats: %lu datagrams in %lu receive calls (avg batch %.2f), %lu frames",
+			 s.datagrams, s.recv_calls, avg_batch, s.frames);
+	msg_Info("stats: %lu wrong client, %lu invalid, %lu written, %lu dropped, %lu superseded, %lu write errors",
+			 s.rejected_client, s.rejected_frame, s.written,
+			 s.dropped, s.superseded, s.write_errors);
+	msg_Info("stats: %lu partial writes, %lu unrouted, %lu suppressed, %lu rate limited",
+			 s.partial_writes, s.unrouted, s.suppressed, s.rate_limited);
+	msg_Info("stats: %.0f datagrams/s, %.2f us CPU per datagram", rate, cpu_per_frame);
+	if (s.link_capacity > 0) {
+		msg_Info("stats: link %.1f of %.1f frames/s (%.1f%% utilisation)",
+				 written_rate, s.link_capacity,
+				 100.0 * written_rate / s.link_capacity);
+	}
+	if (s.tty_delay_samples > 0) {
+		msg_Info("stats: tty queueing delay avg %.2f ms, max %.2f ms",
+				 s.tty_delay_sum_ns / 1e6 / s.tty_delay_samples,
+				 s.tty_delay_max_ns / 1e6);
+	}
+	if (msg_dropped > 0) {
+		msg_Info("stats: %lu log messages dropped", msg_dropped);
+	}
+	serial_print_stats();
+	worker_print_stats();
+	shmingest_print_stats();
+	tcp_print_stats();
+	latency_print_stats();
+}
@@ -0,0 +1,274 @@
+/*****************************************************************************
+ * tcpingest.h: frames over persistent TCP connections
+ *****************************************************************************
+ * Copyright (C) 2011 Kai Hermann
+ *
+ * Authors: Kai Hermann <kai.uwe.hermann at gmail dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/* --tcp: a client keeps a connection open and streams back to back
+ * frames. Reads don't respect frame boundaries, so every connection has
+ * a buffer that keeps the partial frame at its end for the next read.
+ * The buffers come from a pool allocated at startup, one per allowed
+ * connection. Since bytes 1-5 of a frame are < 255, a 255 always starts
+ * a frame; after garbage we skip ahead to the next one. */
+
+void handle_datagram(unsigned char *buffer, int received,
+					 struct sockaddr_in *client, struct allowlist *allow, uint64_t rxstamp);
+
+#define TCP_BUFSIZE (MAXDATAGRAM - MAXDATAGRAM % BUFFSIZE)	/* 245 frames */
+
+struct tcpconn {
+	int fd;			/* -1 = slot free */
+	struct sockaddr_in peer;
+	unsigned char *buf;
+	unsigned int len;	/* bytes in buf */
+	int resync;		/* skipping garbage */
+	struct handler h;
+};
+
+/* fixed set of read buffers, handed out on accept() */
+struct bufpool {
+	unsigned char *mem;
+	unsigned char **free;
+	unsigned int nfree;
+};
+
+struct tcpingest {
+	int sock;
+	struct allowlist *allow;
+	struct tcpconn *conns;
+	unsigned int maxconns;
+	unsigned int nconns;
+	struct bufpool pool;
+	struct handler h;
+
+	unsigned long accepted;
+	unsigned long refused;	/* over --tcp-max or wrong client */
+};
+
+struct tcpingest tcpingest = { .sock = -1 };
+
+void bufpool_init(struct bufpool *p, unsigned int count, unsigned int size)
+{
+	unsigned int i;
+
+	p->mem = malloc((size_t)count * size);
+	p->free = calloc(count, sizeof(unsigned char *));
+	if (p->mem == NULL || p->free == NULL) {
+		die("Unable to allocate connection buffers");
+	}
+	for (i = 0; i < count; i++) {
+		p->free[i] = p->mem + (size_t)i * size;
+	}
+	p->nfree = count;
+}
+
+unsigned char *bufpool_get(struct bufpool *p)
+{
+	return p->nfree > 0 ? p->free[--p->nfree] : NULL;
+}
+
+void bufpool_put(struct bufpool *p, unsigned char *buf)
+{
+	p->free[p->nfree++] = buf;
+}
+
+void tcp_close(struct tcpingest *t, struct tcpconn *c)
+{
+	msg_Dbg("%s disconnected", inet_ntoa(c->peer.sin_addr));
+	reactor_del(&c->h);
+	close(c->fd);
+	bufpool_put(&t->pool, c->buf);
+	c->fd = -1;
+	c->buf = NULL;
+	t->nconns--;
+}
+
+/* hand the whole frames in the buffer on, keep a partial one */
+void tcp_parse(struct tcpconn *c)
+{
+	unsigned char *buf = c->buf;
+	unsigned int in = 0, out = 0, j;
+
+	while (c->len - in >= BUFFSIZE) {
+		if (buf[in] != 255) {
+			if (!c->resync) {
+				rxstats_inc(rejected_frame);
+				c->resync = 1;
+			}
+			in++;
+			continue;
+		}
+
+		/* a second 255 means the frame is cut short, start over there */
+		for (j = 1; j < BUFFSIZE && buf[in + j] != 255; j++)
+			;
+		if (j < BUFFSIZE) {
+			rxstats_inc(rejected_frame);
+			in += j;
+			continue;
+		}
+
+		c->resync = 0;
+		if (out != in)
+			memmove(buf + out, buf + in, BUFFSIZE);
+		out += BUFFSIZE;
+		in += BUFFSIZE;
+	}
+
+	/* the client was checked on accept() */
+	if (out > 0)
+		handle_datagram(buf, out, &c->peer, NULL, 0);
+
+	memmove(buf, buf + in, c->len - in);
+	c->len -= in;
+}
+
+void tcp_conn_event(struct handler *h, unsigned int events)
+{
+	struct tcpconn *c = h->arg;
+	int rounds, n;
+
+	/* a few buffers per turn, then the other fds get theirs */
+	for (rounds = 0; rounds < 16; rounds++) {
+		n = read(c->fd, c->buf + c->len, TCP_BUFSIZE - c->len);
+		if (n > 0) {
+			rxstats_inc(recv_calls);
+			c->len += n;
+			tcp_parse(c);
+			continue;
+		}
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			return;
+		if (n < 0)
+			msg_Dbg("read from %s failed: %s", inet_ntoa(c->peer.sin_addr), strerror(errno));
+		tcp_close(&tcpingest, c);
+		return;
+	}
+}
+
+void tcp_accept_event(struct handler *h, unsigned int events)
+{
+	struct tcpingest *t = h->arg;
+	struct sockaddr_in peer;
+	socklen_t peerlen;
+	unsigned int i;
+	int fd;
+
+	for (;;) {
+		peerlen = sizeof(peer);
+		fd = accept4(t->sock, (struct sockaddr *) &peer, &peerlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				msg_Err("accept() failed: %s", strerror(errno));
+			return;
+		}
+
+		if (t->allow != NULL && !allow_check(t->allow, peer.sin_addr.s_addr)) {
+			rxstats_inc(rejected_client);
+			t->refused++;
+			msg_Info("Wrong client tried to connect to server: %s", inet_ntoa(peer.sin_addr));
+			close(fd);
+			continue;
+		}
+
+		if (t->nconns == t->maxconns) {
+			t->refused++;
+			msg_Info("Too many connections, refusing %s", inet_ntoa(peer.sin_addr));
+			close(fd);
+			continue;
+		}
+
+		for (i = 0; t->conns[i].fd >= 0; i++)
+			;
+		t->conns[i].fd = fd;
+		t->conns[i].peer = peer;
+		t->conns[i].buf = bufpool_get(&t->pool);
+		t->conns[i].len = 0;
+		t->conns[i].resync = 0;
+		t->nconns++;
+		t->accepted++;
+		reactor_add(&t->conns[i].h, fd, EPOLLIN | EPOLLRDHUP, tcp_conn_event, &t->conns[i]);
+		msg_Info("Client connected over TCP: %s", inet_ntoa(peer.sin_addr));
+	}
+}
+
+/* listen on port for up to maxconns streaming clients */
+void tcp_start(struct tcpingest *t, int port, unsigned int maxconns, struct allowlist *allow)
+{
+	struct sockaddr_in server;
+	unsigned int i;
+	int on = 1;
+
+	if ((t->sock = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP)) < 0) {
+		die("Failed to create TCP socket\n");
+	}
+	setsockopt(t->sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	memset(&server, 0, sizeof(server));
+	server.sin_family = AF_INET;
+	server.sin_addr.s_addr = htonl(INADDR_ANY);
+	server.sin_port = htons(port);
+	if (bind(t->sock, (struct sockaddr *) &server, sizeof(server)) < 0) {
+		die("Failed to bind TCP socket\n");
+	}
+	if (listen(t->sock, maxconns) < 0) {
+		die("Failed to listen on TCP socket\n");
+	}
+
+	t->allow = allow;
+	t->maxconns = maxconns;
+	t->nconns = 0;
+	t->conns = calloc(maxconns, sizeof(struct tcpconn));
+	if (t->conns == NULL) {
+		die("Unable to allocate connection table");
+	}
+	for (i = 0; i < maxconns; i++) {
+		t->conns[i].fd = -1;
+	}
+	bufpool_init(&t->pool, maxconns, TCP_BUFSIZE);
+
+	reactor_add(&t->h, t->sock, EPOLLIN, tcp_accept_event, t);
+	msg_Info("Listening on TCP port %i for up to %u connections", port, maxconns);
+}
+
+void tcp_stop(struct tcpingest *t)
+{
+	unsigned int i;
+
+	if (t->sock < 0)
+		return;
+
+	for (i = 0; i < t->maxconns; i++) {
+		if (t->conns[i].fd >= 0)
+			tcp_close(t, &t->conns[i]);
+	}
+	close(t->sock);
+	t->sock = -1;
+}
+
+void tcp_print_stats(void)
+{
+	struct tcpingest *t = &tcpingest;
+
+	if (t->sock < 0)
+		return;
+
+	msg_Info("stats: tcp: %u connections open, %lu accepted, %lu refused",
+			 t->nconns, t->accepted, t->refused);
+}
@@ -0,0 +1,58 @@
+/*****************************************************************************
+ * unixsock.h: unix socket helpers
+ *****************************************************************************
+ * Copyright (C) 2011 Kai Hermann
+ *
+ * Authors: Kai Hermann <kai.uwe.hermann at gmail dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#include <sys/stat.h>
+
+/* bind sock to path with permissions mode, they are the only thing
+ * between the socket and other users. A socket left by a previous run
+ * is replaced, anything else at path is an error, not something to
+ * delete. The umask covers the time between bind() and a chmod().
+ * returns -1 with errno set on failure */
+int unix_bind(int sock, const char *path, mode_t mode)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+	mode_t old;
+	int ret;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	if (lstat(path, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode)) {
+			errno = EEXIST;
+			return -1;
+		}
+		unlink(path);
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	old = umask(~mode & 0777);
+	ret = bind(sock, (struct sockaddr *) &addr, sizeof(addr));
+	umask(old);
+	return ret;
+}
@@ -0,0 +1,583 @@
+/*****************************************************************************
+ * uring.h: io_uring engine for UDP receive and serial write
+ *****************************************************************************
+ * Copyright (C) 2011 Kai Hermann
+ *
+ * Authors: Kai Hermann <kai.uwe.hermann at gmail dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/* The UDP socket gets one multishot recvmsg that stays posted and picks
+ * its buffers from a registered buffer ring, so receiving costs no
+ * submissions at all. Serial frames are submitted as one chain of linked
+ * writes, which keeps them in order without a round trip through epoll.
+ * Task work is deferred to our own io_uring_enter() calls, so ttys don't
+ * see spurious EINTRs; a registered eventfd wakes up the epoll loop.
+ * Everything prepared while handling completions (the receive re-arm and
+ * the chains of all ports) goes to the kernel in one io_uring_enter(),
+ * so a wakeup costs the same two enters however many datagrams and
+ * frames it moves.
+ *
+ * --engine uring-sqpoll hands submissions to a kernel thread instead, which
+ * also posts the completions; a busy server then makes no io_uring_enter()
+ * calls at all, at the price of that thread polling for a while after
+ * every submission. */
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#define URING_ENTRIES 256
+#define URING_CQ_ENTRIES 4096	/* bursts of receives land here */
+#define URING_BUFFERS 256	/* provided receive buffers, power of 2 */
+#define URING_BUFSIZE 1536	/* recvmsg header + sockaddr_in + datagram */
+#define URING_BGID 0
+#define URING_SQ_IDLE_MS 10	/* SQPOLL thread spins this long before it sleeps */
+
+#define URING_TAG_RECV 1
+#define URING_TAG_WRITE 2
+#define URING_TAG_POLL 3
+#define URING_TAG_MASK 0xff	/* the serial port index sits above the tag */
+
+struct uring {
+	int fd;
+	int efd;	/* eventfd signalled on completions */
+
+	/* submission queue */
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array, *sq_flags;
+	struct io_uring_sqe *sqes;
+	unsigned int unsubmitted;	/* published, not yet entered */
+	int batching;			/* in uring_event(), hold submissions back */
+	int sqpoll;			/* a kernel thread takes the submissions */
+
+	/* completion queue */
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ptr, *cq_ptr;
+	size_t sq_len, cq_len, sqes_len;
+
+	/* provided buffers for the multishot receive */
+	struct io_uring_buf_ring *br;
+	unsigned char *bufs;
+	struct msghdr msg;
+	int received_any;
+
+	int sock;
+	struct allowlist *allow;
+	void (*fallback)(void);	/* restart the classic receiver */
+	struct serialport *ports;
+	int nports;
+
+	struct handler h;
+};
+
+struct uring uring = { .fd = -1, .efd = -1 };
+
+void handle_datagram(unsigned char *buffer, int received,
+					 struct sockaddr_in *client, struct allowlist *allow, uint64_t rxstamp);
+
+int uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+int uring_enter(int fd, unsigned int to_submit, unsigned int flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, 0, flags, NULL, 0);
+}
+
+int uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args)
+{
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* hand everything published so far to the kernel, flags can add
+ * IORING_ENTER_GETEVENTS to run the deferred task work on the way */
+void uring_enter_pending(struct uring *u, unsigned int flags)
+{
+	int ret;
+
+	/* the thread sees the new tail by itself unless it went to sleep,
+	 * and the flag must be read after the tail was stored */
+	if (u->sqpoll) {
+		u->unsubmitted = 0;
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(u->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP)
+			flags |= IORING_ENTER_SQ_WAKEUP;
+		if (flags == 0)
+			return;
+	}
+
+	while ((ret = uring_enter(u->fd, u->unsubmitted, flags)) < 0) {
+		if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			die("io_uring_enter() failed");
+		}
+	}
+	u->unsubmitted -= (unsigned int)ret < u->unsubmitted ? (unsigned int)ret : u->unsubmitted;
+}
+
+/* next free sqe, the caller fills it in and calls uring_submit() */
+struct io_uring_sqe *uring_get_sqe(struct uring *u, unsigned int *tail)
+{
+	unsigned int head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+	struct io_uring_sqe *sqe;
+
+	/* held back submissions make room once the kernel has them */
+	if (*tail - head >= URING_ENTRIES && u->unsubmitted > 0) {
+		uring_enter_pending(u, 0);
+		head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+	}
+	if (*tail - head >= URING_ENTRIES)
+		return NULL;
+
+	sqe = &u->sqes[*tail & *u->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	u->sq_array[*tail & *u->sq_mask] = *tail & *u->sq_mask;
+	(*tail)++;
+	return sqe;
+}
+
+/* publish the prepared sqes, the kernel gets them right away or, in
+ * uring_event(), together with everything else at its end */
+void uring_submit(struct uring *u, unsigned int tail)
+{
+	unsigned int count = tail - *u->sq_tail;
+
+	if (count == 0)
+		return;
+
+	__atomic_store_n(u->sq_tail, tail, __ATOMIC_RELEASE);
+	u->unsubmitted += count;
+	if (!u->batching)
+		uring_enter_pending(u, 0);
+}
+
+/* post the multishot recvmsg on the UDP socket */
+void uring_arm_recv(struct uring *u)
+{
+	unsigned int tail = *u->sq_tail;
+	struct io_uring_sqe *sqe = uring_get_sqe(u, &tail);
+
+	if (sqe == NULL)
+		return;
+
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = u->sock;
+	sqe->addr = (unsigned long)&u->msg;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->msg_flags = MSG_TRUNC;	/* payloadlen is the real length */
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	sqe->user_data = URING_TAG_RECV;
+
+	uring_submit(u, tail);
+}
+
+/* hand a consumed buffer back to the kernel */
+void uring_recycle(struct uring *u, unsigned short bid, unsigned short *tail)
+{
+	struct io_uring_buf *buf = &u->br->bufs[*tail & (URING_BUFFERS - 1)];
+
+	buf->addr = (unsigned long)(u->bufs + (size_t)bid * URING_BUFSIZE);
+	buf->len = URING_BUFSIZE;
+	buf->bid = bid;
+	(*tail)++;
+}
+
+/* submit everything in the serial queue as one chain: a poll for
+ * POLLOUT followed by linked non-blocking writes. If the tty fills up
+ * half way, the short or EAGAIN write cancels the rest of the chain and
+ * the next chain starts with a fresh poll. */
+void uring_serial_flush(struct serialport *sp)
+{
+	struct uring *u = &uring;
+	unsigned int tail = *u->sq_tail;
+	unsigned int queued;
+	unsigned long long port = (unsigned long long)sp->index << 8;
+	unsigned int credit;
+	struct io_uring_sqe *sqe;
+	unsigned int i, slot, started = 0;
+
+	/* the running chain has to finish first, its completions move head;
+	 * a port that hung up waits for serial_retry_event() */
+	if (sp->inflight > 0 || sp->fd < 0)
+		return;
+
+	/* nothing is in flight, the shadow is exact for the head frame */
+	serial_skip_redundant(sp);
+	while ((queued = serial_queued(sp)) == 0 && serial_refill(sp) > 0)
+		serial_skip_redundant(sp);
+	if (queued == 0)
+		return;
+
+	/* a partially written head frame already has its slot */
+	credit = (sp->offset > 0) ? UINT_MAX : serial_pace(sp);
+	if (credit == 0)
+		return;
+	if (queued > credit)
+		queued = credit;
+
+	/* keep room for the receive re-arm */
+	if (queued > URING_ENTRIES - 2)
+		queued = URING_ENTRIES - 2;
+
+	sqe = uring_get_sqe(u, &tail);
+	if (sqe == NULL)
+		return;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = sp->fd;
+	sqe->poll32_events = POLLOUT;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->user_data = port | URING_TAG_POLL;
+	sp->inflight++;
+
+	/* dropped frames in between stay where they are, skip them */
+	for (i = 0, slot = sp->head; i < queued; i++, slot++) {
+		unsigned char *frame;
+		unsigned int offset = (i == 0) ? sp->offset : 0;
+
+		while (serial_dead(sp, slot))
+			slot++;
+		frame = sp->queue[slot & sp->mask];
+
+		sqe = uring_get_sqe(u, &tail);
+		if (sqe == NULL)
+			break;
+
+		sqe->opcode = IORING_OP_WRITE;
+		sqe->fd = sp->fd;
+		sqe->addr = (unsigned long)(frame + offset);
+		sqe->len = BUFFSIZE - offset;
+		sqe->off = (__u64)-1;	/* current file position, it's a tty */
+		sqe->flags = IOSQE_IO_LINK | (u->sqpoll ? IOSQE_ASYNC : 0);
+		sqe->user_data = port | URING_TAG_WRITE;
+		sp->inflight++;
+		sp->pinned++;	/* the kernel has the address now */
+		sp->pin_end = slot + 1;
+		if (offset == 0)
+			started++;	/* the rest of a partial frame had its slot */
+	}
+
+	/* the last sqe must not link into whatever is submitted next */
+	u->sqes[(tail - 1) & *u->sq_mask].flags &= ~IOSQE_IO_LINK;
+
+	if (sp->frame_ns != 0)
+		serial_paced(sp, started);
+
+	uring_submit(u, tail);
+}
+
+/* completion of one sqe from the chain, they arrive in order */
+void uring_write_done(struct uring *u, unsigned long long user_data, int res)
+{
+	struct serialport *sp = &u->ports[user_data >> 8];
+	unsigned long long tag = user_data & URING_TAG_MASK;
+
+	sp->inflight--;
+	if (tag == URING_TAG_WRITE)
+		sp->pinned--;
+
+	/* the port hung up under the chain, the frames wait for the new fd */
+	if (sp->fd < 0)
+		return;
+
+	if (tag == URING_TAG_POLL || res == -ECANCELED || res == -EAGAIN || res == -EINTR) {
+		/* nothing written, an earlier link was short or the tty is
+		 * full again, the frame stays queued for the next chain */
+		return;
+	}
+
+	if (res < 0) {
+		stats_inc(write_errors);
+		msg_Err("write() failed!");
+		serial_forget(sp, serial_frame(sp, 0));
+		serial_advance(sp);
+		return;
+	}
+
+	/* the same samples as serial_flush(): the frame left the queue
+	 * with its first bytes, and is on its way to the wire once all
+	 * of it is in the tty */
+	if (sp->offset == 0 && sp->stamps != NULL)
+		latency_record(LAT_QUEUE, sp->stamps[sp->head & sp->mask], reactor_now());
+
+	sp->offset += res;
+	if (sp->offset < BUFFSIZE) {
+		stats_inc(partial_writes);
+	} else {
+		stats_inc(written);
+		sp->written++;
+		msg_Dbg("Value(s) written to serial port");
+		if (sp->stamps != NULL)
+			serial_record_drain(sp);
+		serial_sent(sp, serial_frame(sp, 0));
+		serial_advance(sp);
+	}
+}
+
+void uring_disable(struct uring *u);
+
+/* reap the completion queue, returns 1 if the multishot receive needs
+ * to be posted again and -1 if it doesn't work at all */
+int uring_reap(struct uring *u)
+{
+	unsigned int head = *u->cq_head;
+	unsigned int tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+	unsigned short buf_tail = u->br->tail;
+	int rearm = 0;
+	int received = 0;
+
+	for (; head != tail; head++) {
+		struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+
+		if (cqe->user_data != URING_TAG_RECV) {
+			uring_write_done(u, cqe->user_data, cqe->res);
+			continue;
+		}
+
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+			rearm = 1;
+
+		if (cqe->res < 0) {
+			if (cqe->res != -ENOBUFS && !u->received_any) {
+				/* kernel knows io_uring but not multishot recvmsg */
+				msg_Err("io_uring multishot receive failed: %s", strerror(-cqe->res));
+				rearm = -1;
+				break;
+			}
+			continue;
+		}
+
+		if (cqe->flags & IORING_CQE_F_BUFFER) {
+			unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+			unsigned char *buf = u->bufs + (size_t)bid * URING_BUFSIZE;
+			struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buf;
+			struct sockaddr_in *client = (struct sockaddr_in *)(out + 1);
+			unsigned char *payload = (unsigned char *)(out + 1)
+									 + u->msg.msg_namelen + u->msg.msg_controllen;
+
+			/* payloadlen is the real length, handle_datagram() counts
+			 * what didn't fit like for recvmsg(MSG_TRUNC) */
+			u->received_any = 1;
+			received++;
+			handle_datagram(payload, out->payloadlen, client, u->allow, 0);
+			uring_recycle(u, bid, &buf_tail);
+		}
+	}
+
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	__atomic_store_n(&u->br->tail, buf_tail, __ATOMIC_RELEASE);
+
+	/* one reap is our equivalent of a receive call */
+	if (received > 0)
+		rxstats_inc(recv_calls);
+	return rearm;
+}
+
+/* the eventfd fired: run the deferred task work and reap */
+void uring_event(struct handler *h, unsigned int events)
+{
+	struct uring *u = h->arg;
+	uint64_t count;
+	int rearm = 0;
+	int ret, i;
+
+	if (read(u->efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		msg_Dbg("io_uring eventfd read failed");
+
+	/* datagrams handed to the ports start chains, collect them; with
+	 * SQPOLL there is no task work of ours to run first */
+	u->batching = 1;
+	if (!u->sqpoll)
+		uring_enter_pending(u, IORING_ENTER_GETEVENTS);
+
+	while (42) {
+		ret = uring_reap(u);
+		if (ret < 0) {
+			u->batching = 0;
+			uring_disable(u);
+			return;
+		}
+		rearm |= ret;
+
+		/* overflowed completions and task work queued while we were
+		 * busy only show up after another enter */
+		if (!(__atomic_load_n(u->sq_flags, __ATOMIC_ACQUIRE)
+			  & (IORING_SQ_CQ_OVERFLOW | IORING_SQ_TASKRUN)))
+			break;
+		uring_enter_pending(u, IORING_ENTER_GETEVENTS);
+	}
+
+	if (rearm)
+		uring_arm_recv(u);
+
+	/* a chain may have completed with frames still waiting */
+	for (i = 0; i < u->nports; i++)
+		uring_serial_flush(&u->ports[i]);
+
+	u->batching = 0;
+	if (u->unsubmitted > 0)
+		uring_enter_pending(u, 0);
+}
+
+/* set up the ring, returns -1 if the kernel can't do it
+ * sqpoll: submit through a kernel thread, see above */
+int uring_start(struct uring *u, int sock, struct allowlist *allow,
+				struct serialport *ports, int nports, int sqpoll, void (*fallback)(void))
+{
+	struct io_uring_params p;
+	struct io_uring_buf_reg reg;
+	unsigned int i;
+	int j;
+
+	/* DEFER_TASKRUN needs 6.1, multishot recvmsg 6.0 */
+	memset(&p, 0, sizeof(p));
+	if (sqpoll) {
+		/* the thread runs the task work, nothing to defer */
+		p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SQPOLL;
+		p.sq_thread_idle = URING_SQ_IDLE_MS;
+	} else {
+		p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN
+				  | IORING_SETUP_TASKRUN_FLAG;
+	}
+	p.cq_entries = URING_CQ_ENTRIES;
+	u->fd = uring_setup(URING_ENTRIES, &p);
+	if (u->fd < 0) {
+		msg_Err("io_uring not available: %s", strerror(errno));
+		return -1;
+	}
+
+	u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_len > u->sq_len)
+			u->sq_len = u->cq_len;
+		u->cq_len = u->sq_len;
+	}
+
+	u->sq_ptr = mmap(NULL, u->sq_len, PROT_READ | PROT_WRITE,
+					 MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_ptr == MAP_FAILED)
+		goto fail;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		u->cq_ptr = u->sq_ptr;
+	} else {
+		u->cq_ptr = mmap(NULL, u->cq_len, PROT_READ | PROT_WRITE,
+						 MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+		if (u->cq_ptr == MAP_FAILED)
+			goto fail;
+	}
+
+	u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+				   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+		goto fail;
+
+	u->sq_head = (unsigned int *)((char *)u->sq_ptr + p.sq_off.head);
+	u->sq_tail = (unsigned int *)((char *)u->sq_ptr + p.sq_off.tail);
+	u->sq_mask = (unsigned int *)((char *)u->sq_ptr + p.sq_off.ring_mask);
+	u->sq_flags = (unsigned int *)((char *)u->sq_ptr + p.sq_off.flags);
+	u->sq_array = (unsigned int *)((char *)u->sq_ptr + p.sq_off.array);
+	u->cq_head = (unsigned int *)((char *)u->cq_ptr + p.cq_off.head);
+	u->cq_tail = (unsigned int *)((char *)u->cq_ptr + p.cq_off.tail);
+	u->cq_mask = (unsigned int *)((char *)u->cq_ptr + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)((char *)u->cq_ptr + p.cq_off.cqes);
+
+	/* register the provided buffer ring */
+	u->br = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf),
+				 PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	u->bufs = malloc((size_t)URING_BUFFERS * URING_BUFSIZE);
+	if (u->br == MAP_FAILED || u->bufs == NULL)
+		goto fail;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long)u->br;
+	reg.ring_entries = URING_BUFFERS;
+	reg.bgid = URING_BGID;
+	if (uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		msg_Err("io_uring buffer ring not supported: %s", strerror(errno));
+		goto fail;
+	}
+
+	u->br->tail = 0;
+	for (i = 0; i < URING_BUFFERS; i++) {
+		unsigned short tail = u->br->tail;
+		uring_recycle(u, i, &tail);
+		u->br->tail = tail;
+	}
+
+	/* the kernel lays out header, address and payload in each buffer */
+	memset(&u->msg, 0, sizeof(u->msg));
+	u->msg.msg_namelen = sizeof(struct sockaddr_in);
+
+	u->sock = sock;
+	u->allow = allow;
+	u->fallback = fallback;
+	u->ports = ports;
+	u->nports = nports;
+	u->received_any = 0;
+	u->unsubmitted = 0;
+	u->batching = 0;
+	u->sqpoll = sqpoll;
+
+	u->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (u->efd < 0 || uring_register(u->fd, IORING_REGISTER_EVENTFD, &u->efd, 1) < 0) {
+		msg_Err("io_uring eventfd not supported: %s", strerror(errno));
+		goto fail;
+	}
+	reactor_add(&u->h, u->efd, EPOLLIN, uring_event, u);
+	for (j = 0; j < nports; j++) {
+		ports[j].inflight = 0;
+		ports[j].flush = uring_serial_flush;
+	}
+	uring_arm_recv(u);
+
+	msg_Dbg("io_uring engine started%s", sqpoll ? " with SQPOLL" : "");
+	return 0;
+
+fail:
+	if (u->efd >= 0)
+		close(u->efd);
+	close(u->fd);
+	u->fd = -1;
+	return -1;
+}
+
+/* switch back to the classic engine at runtime */
+void uring_disable(struct uring *u)
+{
+	int i;
+
+	msg_Err("falling back to the classic engine");
+
+	reactor_del(&u->h);
+	close(u->efd);
+	close(u->fd);
+	u->fd = -1;
+	u->unsubmitted = 0;
+
+	u->fallback();
+	for (i = 0; i < u->nports; i++) {
+		u->ports[i].flush = serial_flush;
+		serial_flush(&u->ports[i]);
+	}
+}
@@ -0,0 +1,382 @@
+/*****************************************************************************
+ * xdp.h: AF_XDP receive engine
+ *****************************************************************************
+ * Copyright (C) 2011 Kai Hermann
+ *
+ * Authors: Kai Hermann <kai.uwe.hermann at gmail dot com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/* A small XDP program on one interface sends UDP/IPv4 packets for our
+ * port to an AF_XDP socket, everything else goes on to the stack. The
+ * packets land in a UMEM area we share with the kernel; we parse the
+ * Ethernet, IP and UDP headers ourselves and hand the payload to
+ * handle_datagram(), then give the buffer straight back through the fill
+ * ring. No libbpf: the program is a handful of instructions loaded with
+ * bpf(2), attached with a BPF link, so it goes away when we exit.
+ *
+ * IP options, fragments and VLAN tags are left to the stack, where the
+ * classic receiver picks them up. So does traffic on other interfaces.
+ * The UDP checksum is not verified on this path. */
+
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <net/if.h>
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+#define XDP_RING 2048		/* fill and rx ring entries, power of 2 */
+#define XDP_FRAMES XDP_RING	/* UMEM buffers, all of them start in the fill ring */
+#define XDP_FRAME_SIZE 2048
+
+#define ETH_HLEN_IP 14
+#define UDP_PAYLOAD (ETH_HLEN_IP + 20 + 8)	/* no IP options */
+
+/* producer/consumer ring shared with the kernel */
+struct xdp_ring {
+	unsigned int *producer;
+	unsigned int *consumer;
+	unsigned int *flags;
+	void *ring;
+	void *map;
+	size_t len;
+};
+
+struct xdp {
+	int fd;			/* AF_XDP socket */
+	int map_fd, prog_fd, link_fd;
+	int ifindex;
+	int queue;
+	unsigned char *umem;
+	struct xdp_ring rx, fill, comp;
+	struct allowlist *allow;
+	struct handler h;
+};
+
+struct xdp xdp = { .fd = -1, .map_fd = -1, .prog_fd = -1, .link_fd = -1 };
+
+int xdp_bpf(int cmd, union bpf_attr *attr)
+{
+	return (int)syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/* eBPF instruction */
+struct bpf_insn xdp_insn(unsigned char code, unsigned char dst, unsigned char src,
+						 short off, int imm)
+{
+	struct bpf_insn insn;
+
+	memset(&insn, 0, sizeof(insn));
+	insn.code = code;
+	insn.dst_reg = dst;
+	insn.src_reg = src;
+	insn.off = off;
+	insn.imm = imm;
+	return insn;
+}
+
+/* the redirect program, returns its fd or -1 */
+int xdp_load_prog(int map_fd, int port)
+{
+	struct bpf_insn prog[32];
+	int pass[8], npass = 0, n = 0, i;
+	union bpf_attr attr;
+	char log[4096];
+	int fd;
+
+	/* r2 = data, r3 = data_end, everything up to the UDP payload present */
+	prog[n++] = xdp_insn(BPF_LDX | BPF_MEM | BPF_W, 2, 1, 0, 0);
+	prog[n++] = xdp_insn(BPF_LDX | BPF_MEM | BPF_W, 3, 1, 4, 0);
+	prog[n++] = xdp_insn(BPF_ALU64 | BPF_MOV | BPF_X, 4, 2, 0, 0);
+	prog[n++] = xdp_insn(BPF_ALU64 | BPF_ADD | BPF_K, 4, 0, 0, UDP_PAYLOAD);
+	pass[npass++] = n;
+	prog[n++] = xdp_insn(BPF_JMP | BPF_JGT | BPF_X, 4, 3, 0, 0);
+
+	/* IPv4 without options, UDP, not a fragment, our port */
+	prog[n++] = xdp_insn(BPF_LDX | BPF_MEM | BPF_H, 5, 2, 12, 0);
+	pass[npass++] = n;
+	prog[n++] = xdp_insn(BPF_JMP | BPF_JNE | BPF_K, 5, 0, 0, htons(0x0800));
+	prog[n++] = xdp_insn(BPF_LDX | BPF_MEM | BPF_B, 5, 2, 14, 0);
+	pass[npass++] = n;
+	prog[n++] = xdp_insn(BPF_JMP | BPF_JNE | BPF_K, 5, 0, 0, 0x45);
+	prog[n++] = xdp_insn(BPF_LDX | BPF_MEM | BPF_B, 5, 2, 23, 0);
+	pass[npass++] = n;
+	prog[n++] = xdp_insn(BPF_JMP | BPF_JNE | BPF_K, 5, 0, 0, IPPROTO_UDP);
+	prog[n++] = xdp_insn(BPF_LDX | BPF_MEM | BPF_H, 5, 2, 20, 0);
+	prog[n++] = xdp_insn(BPF_ALU64 | BPF_AND | BPF_K, 5, 0, 0, htons(0x3fff));
+	pass[npass++] = n;
+	prog[n++] = xdp_insn(BPF_JMP | BPF_JNE | BPF_K, 5, 0, 0, 0);
+	prog[n++] = xdp_insn(BPF_LDX | BPF_MEM | BPF_H, 5, 2, 36, 0);
+	pass[npass++] = n;
+	prog[n++] = xdp_insn(BPF_JMP | BPF_JNE | BPF_K, 5, 0, 0, htons(port));
+
+	/* return bpf_redirect_map(&xsks, ctx->rx_queue_index, XDP_PASS) */
+	prog[n++] = xdp_insn(BPF_LDX | BPF_MEM | BPF_W, 2, 1, 16, 0);
+	prog[n++] = xdp_insn(BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, map_fd);
+	prog[n++] = xdp_insn(0, 0, 0, 0, 0);
+	prog[n++] = xdp_insn(BPF_ALU64 | BPF_MOV | BPF_K, 3, 0, 0, XDP_PASS);
+	prog[n++] = xdp_insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map);
+	prog[n++] = xdp_insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+	/* pass: return XDP_PASS */
+	for (i = 0; i < npass; i++) {
+		prog[pass[i]].off = n - pass[i] - 1;
+	}
+	prog[n++] = xdp_insn(BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, XDP_PASS);
+	prog[n++] = xdp_insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.insns = (unsigned long)prog;
+	attr.insn_cnt = n;
+	attr.license = (unsigned long)"GPL";
+	attr.log_buf = (unsigned long)log;
+	attr.log_size = sizeof(log);
+	attr.log_level = 1;
+	log[0] = '\0';
+	fd = xdp_bpf(BPF_PROG_LOAD, &attr);
+	if (fd < 0) {
+		msg_Err("XDP program rejected: %s", strerror(errno));
+		msg_Dbg("%s", log);
+	}
+	return fd;
+}
+
+/* map one of the rings */
+int xdp_map_ring(struct xdp *x, struct xdp_ring *r, struct xdp_ring_offset *off,
+				 size_t entry, off_t pgoff)
+{
+	r->len = off->desc + XDP_RING * entry;
+	r->map = mmap(NULL, r->len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, x->fd, pgoff);
+	if (r->map == MAP_FAILED)
+		return -1;
+	r->producer = (unsigned int *)((char *)r->map + off->producer);
+	r->consumer = (unsigned int *)((char *)r->map + off->consumer);
+	r->flags = (unsigned int *)((char *)r->map + off->flags);
+	r->ring = (char *)r->map + off->desc;
+	return 0;
+}
+
+/* hand buffers to the kernel for receiving */
+void xdp_fill(struct xdp *x, uint64_t *addrs, unsigned int count)
+{
+	unsigned int prod = *x->fill.producer;
+	uint64_t *ring = x->fill.ring;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		ring[(prod + i) & (XDP_RING - 1)] = addrs[i];
+	}
+	__atomic_store_n(x->fill.producer, prod + count, __ATOMIC_RELEASE);
+
+	/* in copy mode the kernel stops looking at an empty fill ring */
+	if (__atomic_load_n(x->fill.flags, __ATOMIC_ACQUIRE) & XDP_RING_NEED_WAKEUP)
+		recvfrom(x->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+}
+
+/* one packet from the rx ring */
+void xdp_packet(struct xdp *x, unsigned char *pkt, unsigned int len)
+{
+	struct sockaddr_in client;
+	unsigned int udplen;
+
+	if (len < UDP_PAYLOAD)
+		return;
+
+	udplen = pkt[ETH_HLEN_IP + 24] << 8 | pkt[ETH_HLEN_IP + 25];
+	if (udplen < 8 || udplen - 8 > len - UDP_PAYLOAD)
+		return;	/* truncated */
+
+	memset(&client, 0, sizeof(client));
+	client.sin_family = AF_INET;
+	memcpy(&client.sin_addr.s_addr, pkt + ETH_HLEN_IP + 12, 4);
+	memcpy(&client.sin_port, pkt + ETH_HLEN_IP + 20, 2);
+
+	handle_datagram(pkt + UDP_PAYLOAD, udplen - 8, &client, x->allow, 0);
+}
+
+void xdp_event(struct handler *h, unsigned int events)
+{
+	struct xdp *x = h->arg;
+	struct xdp_desc *ring = x->rx.ring;
+	uint64_t addrs[64];
+	unsigned int cons, prod, n;
+
+	cons = *x->rx.consumer;
+	prod = __atomic_load_n(x->rx.producer, __ATOMIC_ACQUIRE);
+	if (cons == prod)
+		return;
+	rxstats_inc(recv_calls);
+
+	while (cons != prod) {
+		for (n = 0; n < 64 && cons != prod; n++, cons++) {
+			struct xdp_desc *d = &ring[cons & (XDP_RING - 1)];
+
+			xdp_packet(x, x->umem + d->addr, d->len);
+			addrs[n] = d->addr & ~(uint64_t)(XDP_FRAME_SIZE - 1);
+		}
+		__atomic_store_n(x->rx.consumer, cons, __ATOMIC_RELEASE);
+		xdp_fill(x, addrs, n);
+	}
+}
+
+/* set everything up on ifname, returns -1 if it can't be done */
+int xdp_start(struct xdp *x, const char *ifname, int queue, int port,
+			  struct allowlist *allow)
+{
+	struct xdp_umem_reg mr;
+	struct xdp_mmap_offsets off;
+	struct sockaddr_xdp sxdp;
+	union bpf_attr attr;
+	socklen_t optlen = sizeof(off);
+	int ringsize = XDP_RING;
+	uint64_t addrs[64];
+	unsigned int i, j;
+
+	x->ifindex = if_nametoindex(ifname);
+	if (x->ifindex == 0) {
+		msg_Err("no interface %s", ifname);
+		return -1;
+	}
+	x->queue = queue;
+	x->allow = allow;
+
+	/* map of queue -> AF_XDP socket, and the program using it */
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_XSKMAP;
+	attr.key_size = sizeof(int);
+	attr.value_size = sizeof(int);
+	attr.max_entries = 64;
+	x->map_fd = xdp_bpf(BPF_MAP_CREATE, &attr);
+	if (x->map_fd < 0) {
+		msg_Err("Unable to create XSKMAP: %s", strerror(errno));
+		goto fail;
+	}
+	x->prog_fd = xdp_load_prog(x->map_fd, port);
+	if (x->prog_fd < 0)
+		goto fail;
+
+	/* UMEM and its rings */
+	x->fd = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+	if (x->fd < 0) {
+		msg_Err("AF_XDP not available: %s", strerror(errno));
+		goto fail;
+	}
+	x->umem = mmap(NULL, (size_t)XDP_FRAMES * XDP_FRAME_SIZE, PROT_READ | PROT_WRITE,
+				   MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (x->umem == MAP_FAILED) {
+		x->umem = NULL;
+		msg_Err("Unable to allocate UMEM");
+		goto fail;
+	}
+
+	memset(&mr, 0, sizeof(mr));
+	mr.addr = (unsigned long)x->umem;
+	mr.len = (uint64_t)XDP_FRAMES * XDP_FRAME_SIZE;
+	mr.chunk_size = XDP_FRAME_SIZE;
+	if (setsockopt(x->fd, SOL_XDP, XDP_UMEM_REG, &mr, sizeof(mr)) < 0
+		|| setsockopt(x->fd, SOL_XDP, XDP_UMEM_FILL_RING, &ringsize, sizeof(ringsize)) < 0
+		|| setsockopt(x->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ringsize, sizeof(ringsize)) < 0
+		|| setsockopt(x->fd, SOL_XDP, XDP_RX_RING, &ringsize, sizeof(ringsize)) < 0
+		|| getsockopt(x->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0) {
+		msg_Err("Unable to set up UMEM: %s", strerror(errno));
+		goto fail;
+	}
+
+	if (xdp_map_ring(x, &x->rx, &off.rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) < 0
+		|| xdp_map_ring(x, &x->fill, &off.fr, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING) < 0
+		|| xdp_map_ring(x, &x->comp, &off.cr, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING) < 0) {
+		msg_Err("Unable to map AF_XDP rings: %s", strerror(errno));
+		goto fail;
+	}
+
+	/* zero copy if the driver can, copy mode otherwise */
+	memset(&sxdp, 0, sizeof(sxdp));
+	sxdp.sxdp_family = AF_XDP;
+	sxdp.sxdp_ifindex = x->ifindex;
+	sxdp.sxdp_queue_id = queue;
+	sxdp.sxdp_flags = XDP_USE_NEED_WAKEUP;
+	if (bind(x->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) < 0) {
+		msg_Err("Unable to bind AF_XDP socket to %s queue %i: %s", ifname, queue, strerror(errno));
+		goto fail;
+	}
+
+	for (i = 0; i < XDP_RING; i += 64) {
+		for (j = 0; j < 64; j++) {
+			addrs[j] = (uint64_t)(i + j) * XDP_FRAME_SIZE;
+		}
+		xdp_fill(x, addrs, 64);
+	}
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = x->map_fd;
+	attr.key = (unsigned long)&x->queue;
+	attr.value = (unsigned long)&x->fd;
+	if (xdp_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0) {
+		msg_Err("Unable to add AF_XDP socket to XSKMAP: %s", strerror(errno));
+		goto fail;
+	}
+
+	/* driver mode if the interface has it, generic otherwise */
+	memset(&attr, 0, sizeof(attr));
+	attr.link_create.prog_fd = x->prog_fd;
+	attr.link_create.target_ifindex = x->ifindex;
+	attr.link_create.attach_type = BPF_XDP;
+	x->link_fd = xdp_bpf(BPF_LINK_CREATE, &attr);
+	if (x->link_fd < 0) {
+		attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+		x->link_fd = xdp_bpf(BPF_LINK_CREATE, &attr);
+	}
+	if (x->link_fd < 0) {
+		msg_Err("Unable to attach XDP program to %s: %s", ifname, strerror(errno));
+		goto fail;
+	}
+
+	reactor_add(&x->h, x->fd, EPOLLIN, xdp_event, x);
+	msg_Dbg("AF_XDP engine started on %s queue %i", ifname, queue);
+	return 0;
+
+fail:
+	if (x->fd >= 0)
+		close(x->fd);
+	if (x->prog_fd >= 0)
+		close(x->prog_fd);
+	if (x->map_fd >= 0)
+		close(x->map_fd);
+	if (x->umem != NULL)
+		munmap(x->umem, (size_t)XDP_FRAMES * XDP_FRAME_SIZE);
+	x->umem = NULL;
+	x->fd = x->prog_fd = x->map_fd = -1;
+	return -1;
+}
+
+/* detach the program and release the socket */
+void xdp_stop(struct xdp *x)
+{
+	if (x->fd < 0)
+		return;
+	close(x->link_fd);
+	close(x->fd);
+	close(x->prog_fd);
+	close(x->map_fd);
+	x->fd = -1;
+}